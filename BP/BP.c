@@ -1,20 +1,113 @@
-﻿#include <stdio.h>
+﻿#define _POSIX_C_SOURCE 200112L  /* posix_memalignを使うため */
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	#include <immintrin.h>
+#endif
+
+/* 計算に使う浮動小数点数の型。USE_FLOATを定義してコンパイルすると単精度で計算する。
+ * さらにMASTER_DOUBLEも定義すると、重みの更新だけは倍精度で行なう(混合精度)。 */
+#ifdef USE_FLOAT
+	typedef float real;
+	#ifdef MASTER_DOUBLE
+		#define PRECISION_NAME "mixed"
+	#else
+		#define PRECISION_NAME "float"
+	#endif
+#else
+	#undef MASTER_DOUBLE  /* 全て倍精度なら意味が無い */
+	typedef double real;
+	#define PRECISION_NAME "double"
+#endif
+
+#define INPUT_NEURON_NUM 2  /* ネットワーク定義を省略したときの入力層のニューロン数 */
+#define HIDDEN_NEURON_NUM 2  /* ネットワーク定義を省略したときの中間層のニューロン数 */
+#define OUTPUT_NEURON_NUM 1  /* ネットワーク定義を省略したときの出力層のニューロン数 */
 
-#define INPUT_NEURON_NUM 2  /* 入力層のニューロン数 */
-#define HIDDEN_NEURON_NUM 2  /* 中間層のニューロン数 */
-#define OUTPUT_NEURON_NUM 1  /* 出力層のニューロン数 */
+#define LEARNING_COEFFICIENT 0.1  /* 学習係数 (sgd、momentum、nesterov) */
+#define ADAPTIVE_LEARNING_COEFFICIENT 0.01  /* 勾配の大きさで歩幅を調整する方法の学習係数 (rmsprop、adam) */
 
-#define LEARNING_COEFFICIENT 0.1  /* 学習係数 */
-#define INPUT_PATTERN_NUM 4  /* 入力データのパターン数 */
+#define OPTIMIZER_SGD 0  /* 勾配に学習係数を掛けてそのまま重みから引く */
+#define OPTIMIZER_MOMENTUM 1  /* 過去の勾配を減衰させながら積み重ねた速度で重みを動かす */
+#define OPTIMIZER_NESTEROV 2  /* momentumで、速度で動かした先の勾配を見越して重みを動かす */
+#define OPTIMIZER_RMSPROP 3  /* 勾配の二乗の移動平均で重み毎に歩幅を調整する */
+#define OPTIMIZER_ADAM 4  /* 勾配とその二乗の移動平均を偏りを補正して使う */
+
+#define MOMENTUM_COEFFICIENT 0.9  /* momentumとnesterovで速度を減衰させる係数 */
+#define RMSPROP_DECAY 0.9  /* rmspropで勾配の二乗の移動平均を取る係数 */
+#define ADAM_BETA1 0.9  /* adamで勾配の移動平均を取る係数 */
+#define ADAM_BETA2 0.999  /* adamで勾配の二乗の移動平均を取る係数 */
+#define OPTIMIZER_EPSILON 1e-8  /* rmspropとadamで0除算を防ぐために分母に足す値 */
 
 #define TRAINING_COUNT_MAX 350000  /* 学習回数 */
 #define MINIMAL_ERROR_LEVEL 0.001  /* 許容する誤差の最大値 */
 
 #define LOGFILE_NAME "learning.log"  /* ログファイルの名前 */
+#define PRUNED_LOGFILE_NAME "pruned.log"  /* 枝刈りした後にもう一度学習したときのログファイルの名前 */
+
+#define DATASET_MAGIC "BPDS"  /* バイナリ形式の学習データの先頭に書かれる識別子 */
+#define DATASET_VERSION 1  /* バイナリ形式の学習データの版 */
+#define DATASET_HEADER_SIZE 64  /* バイナリ形式の学習データのヘッダの大きさ。データ部分がキャッシュラインの境界から始まるようにする。 */
+
+#define MODEL_MAGIC "BPMD"  /* 学習済みモデルのファイルの先頭に書かれる識別子 */
+#define MODEL_VERSION 1  /* 学習済みモデルのファイルの版 */
+
+#define INFERENCE_BATCH_SIZE 1024  /* 推論モードで一度に計算するパターンの数 */
+#define READER_BUFFER_SIZE 65536  /* テキストを読み込むときのバッファの大きさ */
+
+#define STRATEGY_SYNC 0  /* 並列学習で、バッチ毎に全スレッドの勾配を合計してから重みを更新する */
+#define STRATEGY_HOGWILD 1  /* 並列学習で、各スレッドがロックせずに共有の重みを直接更新する */
+#define DETERMINISTIC_SEED 2  /* 再現モードで乱数の種を指定しなかったときに使う種 */
+
+#define STREAM_CHUNK_SIZE 4096  /* 逐次学習で、読み込みスレッドが一度に読み込んで渡すパターンの数 */
+#define STREAM_QUEUE_SIZE 4  /* 逐次学習で、読み込んで学習を待っているチャンクを溜めておける数 */
+#define REPLAY_BUFFER_SIZE 65536  /* 逐次学習で、過去のパターンを取っておく数 */
+#define REPLAY_BATCH_NUM 1  /* 逐次学習で、新しいミニバッチ一つ毎に、取っておいたパターンから選んで学習するミニバッチの数 */
+#define SNAPSHOT_INTERVAL 100000  /* 逐次学習で、このパターン数毎に重みを書き出す */
+
+#define REPLICA_CHECK_INTERVAL 1000  /* 多重学習で、この回数の学習毎に他の複製の状況を確かめる */
+#define REPLICA_STALL_RATIO 0.99  /* 多重学習で、前回確かめたときから誤差がこの割合までも減っていなければ停滞しているとみなす */
+#define REPLICA_HOPELESS_RATIO 10.0  /* 多重学習で、停滞した複製の誤差が最良の複製のこの倍以上なら見込みが無いとして打ち切る */
+
+#define GEMM_BLOCK_SIZE 64  /* 行列積をブロック化するときの1ブロックの大きさ。L1キャッシュに3ブロック分が収まる程度にする。 */
+
+#define SIGMOID_EXACT 0  /* シグモイド関数をlibmのexpで計算する */
+#define SIGMOID_FAST 1  /* シグモイド関数を近似したexp(fast_exp)で計算する */
+
+#define FAST_EXP_LIMIT 40.0  /* fast_expに与える値はこの範囲に丸める。シグモイド関数への影響は5e-18未満。 */
+#define FAST_EXP_MAX_ERROR 7.03e-9  /* fast_expの最大相対誤差。±FAST_EXP_LIMITを8000万等分した全ての点でlibmのexpと比べた実測値 (x = -21.14付近で最大)。シグモイド関数の絶対誤差はこの1/4以下になる。 */
+#define FAST_EXPF_MAX_ERROR 2.6e-7  /* USE_FLOATのときのSIMD版fast_expの最大相対誤差 (実測値)。 */
+
+#define SPARSE_BREAK_EVEN 0.8  /* 枝刈りした層の重みの密度がこれ未満なら疎な計算を使う。64-512-512-1のネットワークをバッチ64で計算したときに密な計算と同じ速さになった密度 (実測値)。 */
+
+#define MEMORY_ALIGNMENT 64  /* 各層のバッファの境界。キャッシュラインの大きさに合わせる。 */
+
+#define QUANT_MAX 127  /* int8に量子化した値の絶対値の最大値 */
+#define QUANT_BLOCK_SIZE 16  /* 量子化した重みの一行の要素数をこの倍数に揃える。SIMDで一度に掛け合わせる数。 */
+#define SIGMOID_TABLE_SIZE 4096  /* 量子化した推論で使うシグモイド関数の表の大きさ */
+#define SIGMOID_TABLE_RANGE 8.0  /* シグモイド関数の表が扱う内部状態の範囲 (±)。外側は端の値になり、誤差は3.4e-4未満。 */
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+const char* OPTIMIZER_NAMES[] = {  /* 最適化の方法の名前。添字がOPTIMIZER_*の値。 */
+	"sgd",
+	"momentum",
+	"nesterov",
+	"rmsprop",
+	"adam"
+};
+#define OPTIMIZER_NUM (sizeof(OPTIMIZER_NAMES) / sizeof(char*))
 
 
 /** 出力関数（シグモイド関数）
@@ -30,257 +123,3293 @@ double sigmoid_func(const double net){
 }
 
 
-/** 学習パターンの読み込み
- * 引数で指定されたファイルを開き、入力データと教師データを読み込む。
- * ファイルの各行が一つの入出力パターンに相当し、左からINPUT_NEURON_NUM個が入力値、残りがOUTPUT_NEURON_NUM個分の教師データである。
+/** 近似したexp
+ * exp(x)を多項式で近似して計算する。
+ * x = k*log(2) + r (|r| <= log(2)/2) と分解し、exp(r)を7次のテイラー多項式で求めて2^kを掛ける。
+ * xは±FAST_EXP_LIMITの範囲に丸められ、その範囲での相対誤差はFAST_EXP_MAX_ERROR以下である。
  *
- * 入力データは閾値の代わりに使う入力が一つ追加されるため、ファイルに記録されたデータの数よりも一つ大きい配列を用意する必要がある。
+ * x: 指数。
  *
- * fname: 読み込むファイルの名前。
- * input_data: 入力値を格納する配列。
- * output_data: 出力値（教師データ）を格納する配列。
+ * return: exp(x)の近似値。
  */
-void read_data(
-		const char *fname,
-		double input_data[INPUT_PATTERN_NUM][INPUT_NEURON_NUM+1],
-		double output_data[INPUT_PATTERN_NUM][OUTPUT_NEURON_NUM]
-){
-	int i, k, p;
-	FILE *fp;
+double fast_exp(double x){
+	double k, r, p;
 
-	/* ファイル fname をオープン */
-	if((fp = fopen(fname,"r")) == NULL){
-		printf("read_data(): Cannot open \"%s\"\n", fname);
-		exit(1);
-	}
+	x = x < -FAST_EXP_LIMIT ? -FAST_EXP_LIMIT : (x > FAST_EXP_LIMIT ? FAST_EXP_LIMIT : x);
 
-	/* 学習用データの読み込み */
-	for(p=0; p<INPUT_PATTERN_NUM; p++){
-		for(i=0; i<INPUT_NEURON_NUM; i++){
-			fscanf(fp,"%lf", &input_data[p][i]);
-		}
-		input_data[p][INPUT_NEURON_NUM] = 1;  /* 閾値の代わりに使うための入力。 */
+	k = floor(x * 1.4426950408889634 + 0.5);  /* x / log(2) を丸めたもの */
+	r = x - k * 6.93147180369123816490e-01 - k * 1.90821492927058770002e-10;  /* log(2)を上位と下位に分けて誤差を抑える */
+
+	p = 1.0 + r*(1.0 + r*(1.0/2 + r*(1.0/6 + r*(1.0/24 + r*(1.0/120 + r*(1.0/720 + r*(1.0/5040)))))));
+
+	return ldexp(p, (int)k);
+}
+
+
+#if defined(USE_FLOAT) && defined(__AVX2__)
+/* fast_expの単精度のAVX2版。8つのfloatをまとめて計算する。多項式は6次。 */
+static __m256 fast_expf_avx2(__m256 x){
+	const __m256 shifter = _mm256_set1_ps(12582912.0f);  /* 1.5*2^23。足すと整数部が仮数の下位ビットに入る。 */
+	__m256 k, r, p;
+	__m256i bits;
+
+	x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps((float)FAST_EXP_LIMIT)), _mm256_set1_ps((float)-FAST_EXP_LIMIT));
+
+	k = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), shifter);
+	bits = _mm256_castps_si256(k);
+	k = _mm256_sub_ps(k, shifter);
+
+	r = _mm256_sub_ps(x, _mm256_mul_ps(k, _mm256_set1_ps(0.693145752f)));
+	r = _mm256_sub_ps(r, _mm256_mul_ps(k, _mm256_set1_ps(1.42860677e-6f)));
+
+	p = _mm256_set1_ps(1.0f/720);
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.0f/120));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.0f/24));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.0f/6));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.0f/2));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.0f));
+	p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.0f));
+
+	/* 2^kを指数部に直接組み立てて掛ける */
+	bits = _mm256_slli_epi32(_mm256_add_epi32(bits, _mm256_set1_epi32(127)), 23);
+
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+#elif defined(USE_FLOAT) && defined(__SSE2__)
+/* fast_expの単精度のSSE2版。4つのfloatをまとめて計算する。多項式は6次。 */
+static __m128 fast_expf_sse2(__m128 x){
+	const __m128 shifter = _mm_set1_ps(12582912.0f);  /* 1.5*2^23。足すと整数部が仮数の下位ビットに入る。 */
+	__m128 k, r, p;
+	__m128i bits;
+
+	x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps((float)FAST_EXP_LIMIT)), _mm_set1_ps((float)-FAST_EXP_LIMIT));
+
+	k = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), shifter);
+	bits = _mm_castps_si128(k);
+	k = _mm_sub_ps(k, shifter);
+
+	r = _mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(0.693145752f)));
+	r = _mm_sub_ps(r, _mm_mul_ps(k, _mm_set1_ps(1.42860677e-6f)));
+
+	p = _mm_set1_ps(1.0f/720);
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f/120));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f/24));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f/6));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f/2));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f));
+	p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.0f));
+
+	/* 2^kを指数部に直接組み立てて掛ける */
+	bits = _mm_slli_epi32(_mm_add_epi32(bits, _mm_set1_epi32(127)), 23);
+
+	return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+#elif defined(__AVX2__)
+/* fast_expのAVX2版。4つのdoubleをまとめて計算する。 */
+static __m256d fast_exp_avx2(__m256d x){
+	const __m256d shifter = _mm256_set1_pd(6755399441055744.0);  /* 1.5*2^52。足すと整数部が仮数の下位ビットに入る。 */
+	__m256d k, r, p;
+	__m256i bits;
+
+	x = _mm256_max_pd(_mm256_min_pd(x, _mm256_set1_pd(FAST_EXP_LIMIT)), _mm256_set1_pd(-FAST_EXP_LIMIT));
+
+	k = _mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634)), shifter);
+	bits = _mm256_castpd_si256(k);
+	k = _mm256_sub_pd(k, shifter);
+
+	r = _mm256_sub_pd(x, _mm256_mul_pd(k, _mm256_set1_pd(6.93147180369123816490e-01)));
+	r = _mm256_sub_pd(r, _mm256_mul_pd(k, _mm256_set1_pd(1.90821492927058770002e-10)));
+
+	p = _mm256_set1_pd(1.0/5040);
+	p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0/720));
+	p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0/120));
+	p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0/24));
+	p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0/6));
+	p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0/2));
+	p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0));
+	p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0));
+
+	/* 2^kを指数部に直接組み立てて掛ける */
+	bits = _mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52);
+
+	return _mm256_mul_pd(p, _mm256_castsi256_pd(bits));
+}
+#elif defined(__SSE2__)
+/* fast_expのSSE2版。2つのdoubleをまとめて計算する。 */
+static __m128d fast_exp_sse2(__m128d x){
+	const __m128d shifter = _mm_set1_pd(6755399441055744.0);  /* 1.5*2^52。足すと整数部が仮数の下位ビットに入る。 */
+	__m128d k, r, p;
+	__m128i bits;
+
+	x = _mm_max_pd(_mm_min_pd(x, _mm_set1_pd(FAST_EXP_LIMIT)), _mm_set1_pd(-FAST_EXP_LIMIT));
+
+	k = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(1.4426950408889634)), shifter);
+	bits = _mm_castpd_si128(k);
+	k = _mm_sub_pd(k, shifter);
+
+	r = _mm_sub_pd(x, _mm_mul_pd(k, _mm_set1_pd(6.93147180369123816490e-01)));
+	r = _mm_sub_pd(r, _mm_mul_pd(k, _mm_set1_pd(1.90821492927058770002e-10)));
+
+	p = _mm_set1_pd(1.0/5040);
+	p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0/720));
+	p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0/120));
+	p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0/24));
+	p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0/6));
+	p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0/2));
+	p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0));
+	p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(1.0));
+
+	/* 2^kを指数部に直接組み立てて掛ける */
+	bits = _mm_slli_epi64(_mm_add_epi64(bits, _mm_set1_epi64x(1023)), 52);
 
-		for(k=0; k<OUTPUT_NEURON_NUM; k++){
-			fscanf(fp,"%lf", &output_data[p][k]);
+	return _mm_mul_pd(p, _mm_castsi128_pd(bits));
+}
+#endif
+
+
+/** 配列へのシグモイド関数の適用
+ * 配列xの全ての要素にシグモイド関数を適用し、結果でxを置き換える。
+ * modeがSIGMOID_FASTの場合はfast_expを使い、AVX2かSSE2が使えればそれでまとめて計算する。
+ * USE_FLOATのときは単精度のSIMD命令を使うので、一度に倍の数を計算出来る。
+ *
+ * x: 内部状態の配列。計算結果の出力先でもある。
+ * n: 配列の要素数。
+ * mode: SIGMOID_EXACTかSIGMOID_FASTのどちらか。
+ */
+void sigmoid_array(real *x, const int n, const int mode){
+	int i = 0;
+
+	if(mode == SIGMOID_EXACT){
+		for(i=0; i<n; i++){
+			x[i] = sigmoid_func(x[i]);
 		}
+		return;
 	}
 
-	/* ファイルをクローズ */
-	fclose(fp);
+#if defined(USE_FLOAT) && defined(__AVX2__)
+	for(; i+8<=n; i+=8){
+		const __m256 e = fast_expf_avx2(_mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(x + i)));
+
+		_mm256_storeu_ps(x + i, _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(_mm256_set1_ps(1.0f), e)));
+	}
+#elif defined(USE_FLOAT) && defined(__SSE2__)
+	for(; i+4<=n; i+=4){
+		const __m128 e = fast_expf_sse2(_mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(x + i)));
+
+		_mm_storeu_ps(x + i, _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_set1_ps(1.0f), e)));
+	}
+#elif defined(__AVX2__)
+	for(; i+4<=n; i+=4){
+		const __m256d e = fast_exp_avx2(_mm256_sub_pd(_mm256_setzero_pd(), _mm256_loadu_pd(x + i)));
+
+		_mm256_storeu_pd(x + i, _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_add_pd(_mm256_set1_pd(1.0), e)));
+	}
+#elif defined(__SSE2__)
+	for(; i+2<=n; i+=2){
+		const __m128d e = fast_exp_sse2(_mm_sub_pd(_mm_setzero_pd(), _mm_loadu_pd(x + i)));
+
+		_mm_storeu_pd(x + i, _mm_div_pd(_mm_set1_pd(1.0), _mm_add_pd(_mm_set1_pd(1.0), e)));
+	}
+#endif
+
+	for(; i<n; i++){
+		x[i] = 1 / (1 + fast_exp(-x[i]));
+	}
 }
 
 
-/** 重みの初期化
- * 入力層から中間層、および中間層から出力層への重みを初期化する。
- * 全ての重みは-0.5から0.5までの乱数が代入される。
+/** 配列へのシグモイド関数の微分の適用
+ * シグモイド関数の出力outから微分 out*(1-out) を計算し、誤差信号deltaに掛ける。
  *
- * weight_i2h: 入力層からかくれ層への重みの配列。
- * weight_h2o: かくれ層から出力層への重みの配列。
+ * out: シグモイド関数の出力の配列。
+ * delta: 誤差信号の配列。計算結果の出力先でもある。
+ * n: 配列の要素数。
  */
-void init_weight(
-		double weight_i2h[HIDDEN_NEURON_NUM][INPUT_NEURON_NUM+1],
-		double weight_h2o[OUTPUT_NEURON_NUM][HIDDEN_NEURON_NUM+1]
-){
-	int i, j, k;
+void sigmoid_grad_array(const real *out, real *delta, const int n){
+	int i = 0;
+
+#if defined(USE_FLOAT) && defined(__AVX2__)
+	for(; i+8<=n; i+=8){
+		const __m256 o = _mm256_loadu_ps(out + i);
+		const __m256 d = _mm256_mul_ps(o, _mm256_sub_ps(_mm256_set1_ps(1.0f), o));
+
+		_mm256_storeu_ps(delta + i, _mm256_mul_ps(_mm256_loadu_ps(delta + i), d));
+	}
+#elif defined(USE_FLOAT) && defined(__SSE2__)
+	for(; i+4<=n; i+=4){
+		const __m128 o = _mm_loadu_ps(out + i);
+		const __m128 d = _mm_mul_ps(o, _mm_sub_ps(_mm_set1_ps(1.0f), o));
+
+		_mm_storeu_ps(delta + i, _mm_mul_ps(_mm_loadu_ps(delta + i), d));
+	}
+#elif defined(__AVX2__)
+	for(; i+4<=n; i+=4){
+		const __m256d o = _mm256_loadu_pd(out + i);
+		const __m256d d = _mm256_mul_pd(o, _mm256_sub_pd(_mm256_set1_pd(1.0), o));
+
+		_mm256_storeu_pd(delta + i, _mm256_mul_pd(_mm256_loadu_pd(delta + i), d));
+	}
+#elif defined(__SSE2__)
+	for(; i+2<=n; i+=2){
+		const __m128d o = _mm_loadu_pd(out + i);
+		const __m128d d = _mm_mul_pd(o, _mm_sub_pd(_mm_set1_pd(1.0), o));
+
+		_mm_storeu_pd(delta + i, _mm_mul_pd(_mm_loadu_pd(delta + i), d));
+	}
+#endif
+
+	for(; i<n; i++){
+		delta[i] *= out[i] * (1 - out[i]);
+	}
+}
 
-	srand((unsigned int)time(NULL)); /* 乱数生成器の初期化 */
 
-	/* 入力層から中間層への重みweight_i2h[j][i]を-0.5〜0.5の乱数で初期化 */
-	for(j=0; j<HIDDEN_NEURON_NUM; j++){
-		for(i=0; i<INPUT_NEURON_NUM; i++){
-			weight_i2h[j][i] = ((double)rand()/RAND_MAX) - 0.5;
+/** 行列積 (C = A * B)
+ * 行優先で格納された行列A(m行k列)と行列B(k行n列)の積を計算し、行列C(m行n列)に格納する。
+ * キャッシュに乗るようGEMM_BLOCK_SIZE毎にブロック化し、最内ループがBとCの連続したメモリを走査するように計算する。
+ *
+ * m: 行列Aと行列Cの行数。
+ * n: 行列Bと行列Cの列数。
+ * k: 行列Aの列数と行列Bの行数。
+ * a: 行列Aの先頭へのポインタ。
+ * lda: 行列Aの一行あたりの要素数。
+ * b: 行列Bの先頭へのポインタ。
+ * ldb: 行列Bの一行あたりの要素数。
+ * c: 計算結果を格納する行列Cの先頭へのポインタ。
+ * ldc: 行列Cの一行あたりの要素数。
+ */
+void gemm_nn(
+		const int m, const int n, const int k,
+		const real *a, const int lda,
+		const real *b, const int ldb,
+		real *c, const int ldc
+){
+	int i, j, p, ii, jj, pp;
+
+	for(i=0; i<m; i++){
+		for(j=0; j<n; j++){
+			c[i*ldc + j] = 0;
 		}
 	}
 
-	/* 中間層から出力層への重みweight_h2o[k][j]を-0.5〜0.5の乱数で初期化 */
-	for(k=0; k<OUTPUT_NEURON_NUM; k++){
-		for(j=0; j<HIDDEN_NEURON_NUM; j++){
-			weight_h2o[k][j] = ((double)rand()/RAND_MAX) - 0.5;
+	for(ii=0; ii<m; ii+=GEMM_BLOCK_SIZE){
+		const int i_end = MIN(ii + GEMM_BLOCK_SIZE, m);
+
+		for(pp=0; pp<k; pp+=GEMM_BLOCK_SIZE){
+			const int p_end = MIN(pp + GEMM_BLOCK_SIZE, k);
+
+			for(jj=0; jj<n; jj+=GEMM_BLOCK_SIZE){
+				const int j_end = MIN(jj + GEMM_BLOCK_SIZE, n);
+
+				for(i=ii; i<i_end; i++){
+					real *c_row = c + i*ldc;
+
+					for(p=pp; p<p_end; p++){
+						const real a_ip = a[i*lda + p];
+						const real *b_row = b + p*ldb;
+
+						for(j=jj; j<j_end; j++){
+							c_row[j] += a_ip * b_row[j];
+						}
+					}
+				}
+			}
 		}
 	}
 }
 
 
-/** 出力の計算（前向き計算）
- * 渡された入力値と二つの層の重みを用いてかくれ層、出力層の出力値を計算する。
+/** 転置行列との積 (C = A * B^T)
+ * 行優先で格納された行列A(m行k列)と行列B(n行k列)の転置との積を計算し、行列C(m行n列)に格納する。
+ * 最内ループはAの行とBの行の内積になるので、どちらも連続したメモリを走査する。
  *
- * 入力の配列、二つ重みの配列とかくれ層の配列にはしきい値として使う値が含まれているため、定数で定義されたものより1つ大きなものを使用する。
+ * m: 行列Aと行列Cの行数。
+ * n: 行列Bの行数と行列Cの列数。
+ * k: 行列Aと行列Bの列数。
+ * a: 行列Aの先頭へのポインタ。
+ * lda: 行列Aの一行あたりの要素数。
+ * b: 行列Bの先頭へのポインタ。
+ * ldb: 行列Bの一行あたりの要素数。
+ * c: 計算結果を格納する行列Cの先頭へのポインタ。
+ * ldc: 行列Cの一行あたりの要素数。
+ */
+void gemm_nt(
+		const int m, const int n, const int k,
+		const real *a, const int lda,
+		const real *b, const int ldb,
+		real *c, const int ldc
+){
+	int i, j, p, ii, jj, pp;
+
+	for(i=0; i<m; i++){
+		for(j=0; j<n; j++){
+			c[i*ldc + j] = 0;
+		}
+	}
+
+	for(ii=0; ii<m; ii+=GEMM_BLOCK_SIZE){
+		const int i_end = MIN(ii + GEMM_BLOCK_SIZE, m);
+
+		for(jj=0; jj<n; jj+=GEMM_BLOCK_SIZE){
+			const int j_end = MIN(jj + GEMM_BLOCK_SIZE, n);
+
+			for(pp=0; pp<k; pp+=GEMM_BLOCK_SIZE){
+				const int p_end = MIN(pp + GEMM_BLOCK_SIZE, k);
+
+				for(i=ii; i<i_end; i++){
+					const real *a_row = a + i*lda;
+
+					for(j=jj; j<j_end; j++){
+						const real *b_row = b + j*ldb;
+						real sum = 0;
+
+						for(p=pp; p<p_end; p++){
+							sum += a_row[p] * b_row[p];
+						}
+						c[i*ldc + j] += sum;
+					}
+				}
+			}
+		}
+	}
+}
+
+
+/** 転置行列との積 (C = A^T * B)
+ * 行優先で格納された行列A(k行m列)の転置と行列B(k行n列)との積を計算し、行列C(m行n列)に格納する。
+ * 勾配の計算のように、バッチ方向(k)について足し合わせる用途に使う。
  *
- * input: 入力値。
- * weight_i2h: 入力層からかくれ層への重み。
- * weight_h2o: かくれ層から出力層への重み。
- * h_out: かくれ層の出力先。
- * o_out: 出力層の出力先。
+ * m: 行列Aの列数と行列Cの行数。
+ * n: 行列Bと行列Cの列数。
+ * k: 行列Aと行列Bの行数。
+ * a: 行列Aの先頭へのポインタ。
+ * lda: 行列Aの一行あたりの要素数。
+ * b: 行列Bの先頭へのポインタ。
+ * ldb: 行列Bの一行あたりの要素数。
+ * c: 計算結果を格納する行列Cの先頭へのポインタ。
+ * ldc: 行列Cの一行あたりの要素数。
  */
-void forward_propagation(
-		const double input[INPUT_NEURON_NUM+1],
-		const double weight_i2h[HIDDEN_NEURON_NUM][INPUT_NEURON_NUM+1],
-		const double weight_h2o[OUTPUT_NEURON_NUM][HIDDEN_NEURON_NUM+1],
-		double h_out[HIDDEN_NEURON_NUM+1],
-		double o_out[OUTPUT_NEURON_NUM])
-{
-	int i, j, k;
-	double h_net[HIDDEN_NEURON_NUM];  /* 中間層ニューロンの内部状態 */
-	double o_net[OUTPUT_NEURON_NUM];  /* 出力層ニューロンの内部状態 */
+void gemm_tn(
+		const int m, const int n, const int k,
+		const real *a, const int lda,
+		const real *b, const int ldb,
+		real *c, const int ldc
+){
+	int i, j, p, ii, jj, pp;
 
-	/* 中間層のニューロンの内部状態を計算 */
-	for(j=0; j<HIDDEN_NEURON_NUM; j++){
-		h_net[j] = 0;
-		for(i=0; i<INPUT_NEURON_NUM+1; i++){
-			h_net[j] += weight_i2h[j][i] * input[i];
+	for(i=0; i<m; i++){
+		for(j=0; j<n; j++){
+			c[i*ldc + j] = 0;
 		}
 	}
 
-	/* 中間層のニューロンの出力を計算 */
-	for(j=0; j<HIDDEN_NEURON_NUM; j++){
-		h_out[j] = sigmoid_func(h_net[j]);
+	for(ii=0; ii<m; ii+=GEMM_BLOCK_SIZE){
+		const int i_end = MIN(ii + GEMM_BLOCK_SIZE, m);
+
+		for(pp=0; pp<k; pp+=GEMM_BLOCK_SIZE){
+			const int p_end = MIN(pp + GEMM_BLOCK_SIZE, k);
+
+			for(jj=0; jj<n; jj+=GEMM_BLOCK_SIZE){
+				const int j_end = MIN(jj + GEMM_BLOCK_SIZE, n);
+
+				for(i=ii; i<i_end; i++){
+					real *c_row = c + i*ldc;
+
+					for(p=pp; p<p_end; p++){
+						const real a_pi = a[p*lda + i];
+						const real *b_row = b + p*ldb;
+
+						for(j=jj; j<j_end; j++){
+							c_row[j] += a_pi * b_row[j];
+						}
+					}
+				}
+			}
+		}
 	}
+}
+
+
+/** 疎な重み
+ * 枝刈りした層の残った重みを圧縮行格納(CSR)形式で並べたもの。閾値の分は含まない。
+ * neuron_num行input_num列の重み行列のうち、j行目の残った重みはvalue[row[j]]からvalue[row[j+1]-1]までで、その列の番号がcolに入っている。
+ */
+typedef struct {
+	int nnz;  /* 残った重みの数 */
+	int use;  /* 0以外なら疎な計算を使う。0なら密な計算のまま、枝刈りした重みを0に保つだけにする。 */
+	int *row;  /* 各行の残った重みの開始位置。neuron_num+1個。 */
+	int *col;  /* 残った重みの列の番号。nnz個。 */
+	real *value;  /* 残った重みの値。nnz個。 */
+} SparseWeight;
+
+
+/** 疎行列の転置との積 (C = A * W^T)
+ * 行列A(m行k列)と疎な重みW(n行k列)の転置との積を計算し、行列C(m行n列)に格納する。
+ * 計算量はgemm_ntのm*n*kに対して、m*nnzになる。
+ *
+ * m: 行列Aと行列Cの行数。
+ * n: 重みWの行数と行列Cの列数。
+ * w: 疎な重みW。
+ * a: 行列Aの先頭へのポインタ。
+ * lda: 行列Aの一行あたりの要素数。
+ * c: 計算結果を格納する行列Cの先頭へのポインタ。
+ * ldc: 行列Cの一行あたりの要素数。
+ */
+void sparse_gemm_nt(
+		const int m, const int n,
+		const SparseWeight *w,
+		const real *a, const int lda,
+		real *c, const int ldc
+){
+	int i, j, e;
 
-	h_out[HIDDEN_NEURON_NUM] = 1.0;  /* 中間層の常に1を出力するニューロンの出力を設定 (閾値の分) */
+	for(i=0; i<m; i++){
+		const real *a_row = a + i*lda;
 
-	/* 出力層のニューロンの内部状態を計算 */
-	for(k=0; k<OUTPUT_NEURON_NUM; k++){
-		o_net[k] = 0;
-		for(j=0; j<HIDDEN_NEURON_NUM+1; j++){
-			o_net[k] += weight_h2o[k][j] * h_out[j];
+		for(j=0; j<n; j++){
+			real sum = 0;
+
+			for(e=w->row[j]; e<w->row[j+1]; e++){
+				sum += w->value[e] * a_row[w->col[e]];
+			}
+			c[i*ldc + j] = sum;
 		}
 	}
+}
+
+
+/** 疎行列との積 (C = A * W)
+ * 行列A(m行n列)と疎な重みW(n行k列)との積を計算し、行列C(m行k列)に格納する。
+ *
+ * m: 行列Aと行列Cの行数。
+ * n: 行列Aの列数と重みWの行数。
+ * k: 重みWと行列Cの列数。
+ * w: 疎な重みW。
+ * a: 行列Aの先頭へのポインタ。
+ * lda: 行列Aの一行あたりの要素数。
+ * c: 計算結果を格納する行列Cの先頭へのポインタ。
+ * ldc: 行列Cの一行あたりの要素数。
+ */
+void sparse_gemm_nn(
+		const int m, const int n, const int k,
+		const SparseWeight *w,
+		const real *a, const int lda,
+		real *c, const int ldc
+){
+	int i, j, e;
+
+	for(i=0; i<m; i++){
+		real *c_row = c + i*ldc;
+
+		for(j=0; j<k; j++){
+			c_row[j] = 0;
+		}
+		for(j=0; j<n; j++){
+			const real a_ij = a[i*lda + j];
 
-	/* 出力層のニューロンの出力を計算 */
-	for(k=0; k<OUTPUT_NEURON_NUM; k++){
-		o_out[k] = sigmoid_func(o_net[k]);
+			for(e=w->row[j]; e<w->row[j+1]; e++){
+				c_row[w->col[e]] += a_ij * w->value[e];
+			}
+		}
 	}
 }
 
 
-/** 学習する（後ろ向き計算）
- * 入力と各層の出力、教師信号から重みを再計算（後ろ向き計算）し、学習を行なう。
+/** 疎な重みの勾配 (C = A^T * B、ただしWの非零要素の位置だけ)
+ * 行列A(k行n列)の転置と行列B(k行m列)との積のうち、疎な重みW(n行m列)に残った重みの位置だけを計算して行列C(n行m列)に格納する。
+ * それ以外の位置は0になる。
  *
- * input: 入力された値。
- * h_out: かくれ層の出力。
- * o_out: 出力層の出力。
- * output: 出力されるべき値。教師信号。
- * weight_i2h: 入力層からかくれ層への重み。
- * weight_h2o: かくれ層から出力層への重み。
+ * n: 行列Aの列数と行列Cの行数。
+ * m: 行列Bと行列Cの列数。
+ * k: 行列Aと行列Bの行数。
+ * w: 疎な重みW。
+ * a: 行列Aの先頭へのポインタ。
+ * lda: 行列Aの一行あたりの要素数。
+ * b: 行列Bの先頭へのポインタ。
+ * ldb: 行列Bの一行あたりの要素数。
+ * c: 計算結果を格納する行列Cの先頭へのポインタ。
+ * ldc: 行列Cの一行あたりの要素数。
  */
-void back_propagation(
-		const double input[INPUT_NEURON_NUM+1],
-		const double h_out[HIDDEN_NEURON_NUM+1],
-		const double o_out[OUTPUT_NEURON_NUM],
-		const double output[OUTPUT_NEURON_NUM],
-		double weight_i2h[HIDDEN_NEURON_NUM][INPUT_NEURON_NUM+1],
-		double weight_h2o[OUTPUT_NEURON_NUM][HIDDEN_NEURON_NUM+1]
+void sparse_gemm_tn(
+		const int n, const int m, const int k,
+		const SparseWeight *w,
+		const real *a, const int lda,
+		const real *b, const int ldb,
+		real *c, const int ldc
 ){
-	int i, j, k;
+	int i, j, p, e;
 
-	/* 中間層から出力層への重みweight_h2o[k][j]の更新 */
-	for(k=0; k<OUTPUT_NEURON_NUM; k++){
-		for(j=0; j<HIDDEN_NEURON_NUM; j++){
-			weight_h2o[k][j] -= LEARNING_COEFFICIENT
-								* (o_out[k] - output[k]) * o_out[k]
-								* (1 - o_out[k]) * h_out[j];
+	for(j=0; j<n; j++){
+		for(i=0; i<m; i++){
+			c[j*ldc + i] = 0;
 		}
 	}
+	for(p=0; p<k; p++){
+		const real *b_row = b + p*ldb;
 
-	/* 入力層から中間層への重みweight_i2h[j][i]の更新 */
-	for(j=0; j<HIDDEN_NEURON_NUM; j++){
-		for(i=0; i<INPUT_NEURON_NUM; i++){
-			double old = weight_i2h[j][i];
+		for(j=0; j<n; j++){
+			const real a_pj = a[p*lda + j];
+			real *c_row = c + j*ldc;
 
-			weight_i2h[j][i] = 0;
-			for(k=0; k<OUTPUT_NEURON_NUM; k++){
-				weight_i2h[j][i] -= (o_out[k] - output[k])
-									* o_out[k] * (1 - o_out[k])
-									* weight_h2o[k][j];
+			for(e=w->row[j]; e<w->row[j+1]; e++){
+				c_row[w->col[e]] += a_pj * b_row[w->col[e]];
 			}
-			weight_i2h[j][i] *= LEARNING_COEFFICIENT
-								* h_out[j] * (1 - h_out[j])
-								* input[i];
-			weight_i2h[j][i] += old;
 		}
 	}
 }
 
 
-/** メイン関数
- * 学習に使用するデータファイルの名前を引数で受け取り、誤差逆伝播法で学習、学習結果とそのスコアを表示する。
- * スコアは期待する出力との差の合計であり、小さいほど実際の出力と教師データが近いことを示す。
+/** 一つの層
+ * 入力層を除く一つの層の重みと計算途中の値。
+ * 全ての配列は一つの連続したバッファ(buffer)の中にMEMORY_ALIGNMENT境界で並べて確保される。
  */
-int main(const int argc, const char *argv[]){
-	double weight_i2h[HIDDEN_NEURON_NUM][INPUT_NEURON_NUM+1];  /* 入力層から中間層への重み */		
-	double weight_h2o[OUTPUT_NEURON_NUM][HIDDEN_NEURON_NUM+1];  /* 中間層から出力層への重み */		
-	double h_out[HIDDEN_NEURON_NUM+1];  /* 中間層ニューロンの出力 */		
-	double o_out[OUTPUT_NEURON_NUM];  /* 出力層ニューロンの出力 */		
-	double input[INPUT_PATTERN_NUM][INPUT_NEURON_NUM+1];  /* 入力パターン */
-	double output[INPUT_PATTERN_NUM][OUTPUT_NEURON_NUM];  /* 出力パターン(教師信号) */
-	double error;  /* 誤差 */ 
-	FILE *log_file;  /* ファイルポインタ (誤差データの保存用) */
-	int i, p, k;
+typedef struct {
+	int input_num;  /* この層への入力の数 (閾値の分は含まない) */
+	int neuron_num;  /* この層のニューロン数 */
+	void *buffer;  /* 以下の配列をまとめて確保したバッファ */
+	real *weight;  /* 重み。neuron_num行(input_num+1)列で、最後の列が閾値の代わり。 */
+#ifdef MASTER_DOUBLE
+	double *master;  /* 倍精度の重み。更新はこちらに対して行ない、weightはその写しになる。 */
+#endif
+	real *grad;  /* 重みの勾配。weightと同じ形。 */
+	double *moment1;  /* 最適化の方法が重み毎に持つ一つ目の状態。momentumとnesterovでは速度、adamでは勾配の移動平均。weightと同じ形。 */
+	double *moment2;  /* 最適化の方法が重み毎に持つ二つ目の状態。rmspropとadamでの勾配の二乗の移動平均。weightと同じ形。 */
+	real *out;  /* ニューロンの出力。batch_size行neuron_num列。 */
+	real *delta;  /* 誤差信号。outと同じ形。 */
+	SparseWeight *sparse;  /* 枝刈りした重み。枝刈りしていなければNULL。 */
+} Layer;
+
+
+/** ネットワーク
+ * 入力層以外の全ての層と、一度に計算出来るパターンの数。
+ */
+typedef struct {
+	int layer_num;  /* 層の数 (入力層は含まない) */
+	int batch_size;  /* 一度に計算出来るパターンの最大数 */
+	int sigmoid_mode;  /* シグモイド関数の計算方法。SIGMOID_EXACTかSIGMOID_FAST。 */
+	int optimizer;  /* 最適化の方法。OPTIMIZER_*のどれか。 */
+	double learning_rate;  /* 学習係数 */
+	int step;  /* update_weightで重みを更新した回数 */
+	int kernel;  /* 形に合わせた専用の計算(SMALL_KERNELS)の番号。-1なら汎用の計算を使う。 */
+	Layer *layers;  /* 各層。最後の要素が出力層。 */
+} Network;
+
+
+/** 学習データ
+ * 入力値と教師データの組を一行として、全パターン分を連続したメモリに格納したもの。
+ */
+typedef struct {
+	int input_num;  /* 一パターンあたりの入力値の数 */
+	int output_num;  /* 一パターンあたりの教師データの数 */
+	int pattern_num;  /* パターンの数 */
+	real *data;  /* pattern_num行(input_num+output_num)列の行列。各行の後ろoutput_num個が教師データ。 */
+	void *mapping;  /* バイナリ形式のファイルをメモリマップした領域。テキストから読み込んだ場合はNULL。 */
+	size_t mapping_size;  /* メモリマップした領域の大きさ */
+} Dataset;
+
+
+/** バイナリ形式の学習データのヘッダ
+ * バイナリ形式の学習データのファイルの先頭に置かれる情報。
+ * ヘッダの後にはpattern_num行(input_num+output_num)列のreal型の行列がそのまま続く。
+ * 数値は全て書き込んだ計算機のバイトオーダーで記録される。
+ */
+typedef struct {
+	char magic[4];  /* DATASET_MAGIC */
+	int version;  /* DATASET_VERSION */
+	int input_num;  /* 一パターンあたりの入力値の数 */
+	int output_num;  /* 一パターンあたりの教師データの数 */
+	int pattern_num;  /* パターンの数 */
+	int element_size;  /* 一つの値の大きさ。sizeof(real)。 */
+	char reserved[DATASET_HEADER_SIZE - 4 - sizeof(int)*5];  /* DATASET_HEADER_SIZEに揃えるための余白 */
+} DatasetHeader;
+
+
+/** 学習済みモデルのファイルのヘッダ
+ * 学習済みモデルのファイルの先頭に置かれる情報。
+ * ヘッダの後には各層のニューロン数がintでlayer_num個続き、その後に各層の重みがdoubleで入力層に近い方から順に続く。
+ * 重みは計算に使う型に関わらず倍精度で記録するので、単精度と倍精度のどちらで学習したモデルも読み込める。
+ * 数値は全て書き込んだ計算機のバイトオーダーで記録される。
+ */
+typedef struct {
+	char magic[4];  /* MODEL_MAGIC */
+	int version;  /* MODEL_VERSION */
+	int layer_num;  /* 層の数 (入力層を含む) */
+	int element_size;  /* 一つの重みの大きさ。sizeof(double)。 */
+} ModelHeader;
+
+
+/** テキストの読み込み器
+ * ファイルからスペースや改行で区切られた数値を、大きなバッファ単位で読み込むためのもの。
+ */
+typedef struct {
+	FILE *fp;  /* 読み込むファイル */
+	char *buffer;  /* 読み込んだテキスト。READER_BUFFER_SIZE+1バイト。 */
+	size_t pos;  /* 次に読む位置 */
+	size_t len;  /* バッファに入っているテキストの長さ */
+	int eof;  /* ファイルの終わりまで読んだら0以外 */
+} TextReader;
+
+
+/** 境界を揃えたメモリの確保
+ * MEMORY_ALIGNMENTの境界に揃えたメモリをsizeバイト確保する。
+ * 確保に失敗した場合はエラーを表示してプログラムを終了させる。
+ * 確保したメモリはfreeで解放する。
+ *
+ * size: 確保するバイト数。
+ *
+ * return: 確保したメモリへのポインタ。
+ */
+void* alloc_aligned(const size_t size){
+	void *ptr;
 
-	/* 引数の数の確認 (引数の数が正しくないときは実行方法を表示) */
-	if(argc <= 1){
-		printf("実行方法 : ./a.out [LEARNING DATA]\n");
+	if(posix_memalign(&ptr, MEMORY_ALIGNMENT, size > 0 ? size : MEMORY_ALIGNMENT) != 0){
+		printf("alloc_aligned(): Cannot allocate %lu bytes\n", (unsigned long)size);
 		exit(1);
 	}
 
-	/* ログファイルをオープン */
-	if((log_file = fopen(LOGFILE_NAME, "weight_h2o")) == NULL){
-		printf("main(): Cannot open \"%s\"\n", LOGFILE_NAME);
-		exit(1);
+	return ptr;
+}
+
+
+/** 境界に揃えた大きさ
+ * 配列をMEMORY_ALIGNMENTの境界で並べるために、バイト数sizeを切り上げる。
+ *
+ * size: 配列のバイト数。
+ *
+ * return: 切り上げたバイト数。
+ */
+size_t align_size(const size_t size){
+	return (size + MEMORY_ALIGNMENT - 1) / MEMORY_ALIGNMENT * MEMORY_ALIGNMENT;
+}
+
+
+/* 入力層I個、中間層H個、出力層O個の三層のネットワーク専用の前向き計算と後向き計算を定義する。
+ * ループの回数が全て定数になるので、コンパイラがループを展開して添字の計算や終了判定を省ける。
+ * 足し合わせる順番はforward_propagationとback_propagationと同じなので、結果も同じになる。 */
+#define DEFINE_SMALL_KERNEL(I, H, O) \
+static void forward_##I##_##H##_##O(const Network *net, const real *input, const int ld_input, const int batch_size){ \
+	const real *w1 = net->layers[0].weight, *w2 = net->layers[1].weight; \
+	real *h = net->layers[0].out, *o = net->layers[1].out; \
+	real sum; \
+	int j, k, p; \
+	\
+	for(p=0; p<batch_size; p++){ \
+		for(j=0; j<H; j++){ \
+			sum = 0; \
+			for(k=0; k<I; k++){ \
+				sum += input[p*ld_input + k] * w1[j*(I+1) + k]; \
+			} \
+			h[p*H + j] = sum + w1[j*(I+1) + I]; \
+		} \
+	} \
+	sigmoid_array(h, batch_size * H, net->sigmoid_mode); \
+	\
+	for(p=0; p<batch_size; p++){ \
+		for(j=0; j<O; j++){ \
+			sum = 0; \
+			for(k=0; k<H; k++){ \
+				sum += h[p*H + k] * w2[j*(H+1) + k]; \
+			} \
+			o[p*O + j] = sum + w2[j*(H+1) + H]; \
+		} \
+	} \
+	sigmoid_array(o, batch_size * O, net->sigmoid_mode); \
+} \
+\
+static void backward_##I##_##H##_##O( \
+		const Network *net, const real *input, const int ld_input, const real *target, const int ld_target, const int batch_size){ \
+	const Layer *hidden = &net->layers[0], *last = &net->layers[1]; \
+	real g1[H*(I+1)], g2[O*(H+1)];  /* 勾配をレジスタに置けるように局所変数で足し合わせる */ \
+	real d, sum; \
+	int j, k, p; \
+	\
+	for(p=0; p<batch_size; p++){ \
+		for(j=0; j<O; j++){ \
+			last->delta[p*O + j] = last->out[p*O + j] - target[p*ld_target + j]; \
+		} \
+	} \
+	sigmoid_grad_array(last->out, last->delta, batch_size * O); \
+	\
+	for(j=0; j<O*(H+1); j++){ \
+		g2[j] = 0; \
+	} \
+	for(p=0; p<batch_size; p++){ \
+		for(j=0; j<O; j++){ \
+			d = last->delta[p*O + j]; \
+			for(k=0; k<H; k++){ \
+				g2[j*(H+1) + k] += d * hidden->out[p*H + k]; \
+			} \
+			g2[j*(H+1) + H] += d; \
+		} \
+		for(k=0; k<H; k++){ \
+			sum = 0; \
+			for(j=0; j<O; j++){ \
+				sum += last->delta[p*O + j] * last->weight[j*(H+1) + k]; \
+			} \
+			hidden->delta[p*H + k] = sum; \
+		} \
+	} \
+	sigmoid_grad_array(hidden->out, hidden->delta, batch_size * H); \
+	\
+	for(j=0; j<H*(I+1); j++){ \
+		g1[j] = 0; \
+	} \
+	for(p=0; p<batch_size; p++){ \
+		for(j=0; j<H; j++){ \
+			d = hidden->delta[p*H + j]; \
+			for(k=0; k<I; k++){ \
+				g1[j*(I+1) + k] += d * input[p*ld_input + k]; \
+			} \
+			g1[j*(I+1) + I] += d; \
+		} \
+	} \
+	\
+	for(j=0; j<O*(H+1); j++){ \
+		last->grad[j] = g2[j]; \
+	} \
+	for(j=0; j<H*(I+1); j++){ \
+		hidden->grad[j] = g1[j]; \
+	} \
+}
+
+DEFINE_SMALL_KERNEL(2, 2, 1)
+DEFINE_SMALL_KERNEL(2, 3, 1)
+DEFINE_SMALL_KERNEL(2, 4, 1)
+DEFINE_SMALL_KERNEL(2, 8, 1)
+
+
+/** 専用の計算
+ * DEFINE_SMALL_KERNELで定義した、ある形のネットワーク専用の前向き計算と後向き計算の組。
+ */
+typedef struct {
+	int input_num;  /* 入力層のニューロン数 */
+	int hidden_num;  /* 中間層のニューロン数 */
+	int output_num;  /* 出力層のニューロン数 */
+	void (*forward)(const Network *, const real *, int, int);  /* forward_propagationの代わり */
+	void (*backward)(const Network *, const real *, int, const real *, int, int);  /* back_propagationの代わり */
+} SmallKernel;
+
+#define SMALL_KERNEL(I, H, O) {I, H, O, forward_##I##_##H##_##O, backward_##I##_##H##_##O}
+
+const SmallKernel SMALL_KERNELS[] = {  /* 専用の計算の一覧。ここに無い形のネットワークは汎用の計算を使う。 */
+	SMALL_KERNEL(2, 2, 1),
+	SMALL_KERNEL(2, 3, 1),
+	SMALL_KERNEL(2, 4, 1),
+	SMALL_KERNEL(2, 8, 1)
+};
+#define SMALL_KERNEL_NUM (sizeof(SMALL_KERNELS) / sizeof(SmallKernel))
+
+
+/** 専用の計算の選択
+ * ネットワークの形に合う専用の計算をSMALL_KERNELSから探す。
+ *
+ * net: 計算するネットワーク。
+ *
+ * return: 見つかった専用の計算の番号。無ければ-1。
+ */
+int find_small_kernel(const Network *net){
+	int i;
+
+	if(net->layer_num != 2){
+		return -1;
+	}
+	for(i=0; i<(int)SMALL_KERNEL_NUM; i++){
+		if(SMALL_KERNELS[i].input_num == net->layers[0].input_num
+				&& SMALL_KERNELS[i].hidden_num == net->layers[0].neuron_num
+				&& SMALL_KERNELS[i].output_num == net->layers[1].neuron_num){
+			return i;
+		}
 	}
 
-	/* 学習データの読み込み */
-	read_data(argv[1], input, output);
+	return -1;
+}
 
-	/* 重みの初期化 */
-	init_weight(weight_i2h, weight_h2o);
 
-	error=20.0; /* 誤差(error)を適当な値に設定 */
-	for(i=0; i<TRAINING_COUNT_MAX && error > MINIMAL_ERROR_LEVEL; i++){
-		error = 0.0; 
-		for(p=0; p<INPUT_PATTERN_NUM; p++){
-			forward_propagation  /* 出力の計算 (前向き計算) */(
-				input[p],
-				(const double (*)[INPUT_NEURON_NUM+1])weight_i2h,
-				(const double (*)[HIDDEN_NEURON_NUM+1])weight_h2o,
-				h_out,
-				o_out
-			);
-			back_propagation(input[p], h_out, o_out, output[p], weight_i2h, weight_h2o);  /* 出力と教師信号を元に学習 (後向き計算) */			 
+/** ネットワーク定義の読み込み
+ * 引数で指定されたファイルから各層のニューロン数を読み込む。
+ * ファイルはスペースもしくは改行区切りの整数で、先頭が入力層、最後が出力層のニューロン数である。
+ * 間に並べた数だけ中間層が作られる。
+ *
+ * fname: 読み込むファイルの名前。
+ * widths: 読み込んだニューロン数の配列の保存先。配列はmallocで確保されるので、使い終わったらfreeすること。
+ *
+ * return: 読み込んだ層の数 (入力層を含む)。
+ */
+int read_network(const char *fname, int **widths){
+	int num = 0, capacity = 4, width;
+	FILE *fp;
 
-			/* パターンpに対する誤差の計算 (errorに加算) */
-			for(k=0; k<OUTPUT_NEURON_NUM; k++){
-				error += ((o_out[k] - output[p][k]) * (o_out[k] - output[p][k])) / 2;
-			}
+	/* ファイル fname をオープン */
+	if((fp = fopen(fname, "r")) == NULL){
+		printf("read_network(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+
+	*widths = malloc(sizeof(int) * capacity);
+	while(fscanf(fp, "%d", &width) == 1){
+		if(width <= 0){
+			printf("read_network(): Invalid neuron number %d in \"%s\"\n", width, fname);
+			exit(1);
 		}
-		fprintf(log_file, "%d %f\n", i, error);  /* 誤差(error)をファイルに書き込む */
+		if(num >= capacity){
+			capacity *= 2;
+			*widths = realloc(*widths, sizeof(int) * capacity);
+		}
+		(*widths)[num++] = width;
 	}
 
-	fclose(log_file);  /* ログファイルを閉じる。 */
+	/* ファイルをクローズ */
+	fclose(fp);
 
+	if(num < 2){
+		printf("read_network(): \"%s\" needs at least input and output layers\n", fname);
+		exit(1);
+	}
 
-	/* 計算して結果を出力する。 */
-	double score = 0;
-	for(p=0; p<INPUT_PATTERN_NUM; p++){
-		forward_propagation(
-			input[p],
-			(const double (*)[INPUT_NEURON_NUM+1])weight_i2h,
-			(const double (*)[HIDDEN_NEURON_NUM+1])weight_h2o,
-			h_out,
-			o_out
-		);
-
-		score += fabs(output[p][0] - o_out[0]);
-
-		printf("[%d] %lf %lf ===> %lf (%lf)\n",
-			p,
-			input[p][0], input[p][1],
-			o_out[0], output[p][0]
-		);
-	}
-	printf("\nscore: %lf\n", score / (double)INPUT_PATTERN_NUM);
+	return num;
+}
+
+
+/** ネットワークの確保
+ * 各層のニューロン数を元にネットワークを作る。
+ * 各層の重み、勾配、最適化の状態、出力、誤差信号は層毎に一つの連続したバッファに確保される。
+ * 最適化の状態は0で初期化され、最適化の方法はOPTIMIZER_SGDになる。
+ * 形に合う専用の計算がSMALL_KERNELSにあれば、forward_propagationとback_propagationはそれを使う。
+ *
+ * net: 初期化するネットワーク。
+ * widths: 各層のニューロン数。先頭が入力層、最後が出力層。
+ * width_num: widthsの要素数。
+ * batch_size: 一度に計算出来るパターンの最大数。
+ */
+void init_network(Network *net, const int *widths, const int width_num, const int batch_size){
+	int l;
+
+	net->layer_num = width_num - 1;
+	net->batch_size = batch_size;
+	net->sigmoid_mode = SIGMOID_EXACT;
+	net->optimizer = OPTIMIZER_SGD;
+	net->learning_rate = LEARNING_COEFFICIENT;
+	net->step = 0;
+	net->layers = malloc(sizeof(Layer) * net->layer_num);
+
+	for(l=0; l<net->layer_num; l++){
+		Layer *layer = &net->layers[l];
+		const size_t weight_size = align_size(sizeof(real) * widths[l+1] * (widths[l] + 1));
+		const size_t out_size = align_size(sizeof(real) * batch_size * widths[l+1]);
+		const size_t moment_size = align_size(sizeof(double) * widths[l+1] * (widths[l] + 1));
+#ifdef MASTER_DOUBLE
+		const size_t master_size = align_size(sizeof(double) * widths[l+1] * (widths[l] + 1));
+#else
+		const size_t master_size = 0;
+#endif
+		char *buffer = alloc_aligned(weight_size*2 + out_size*2 + master_size + moment_size*2);
+
+		layer->input_num = widths[l];
+		layer->neuron_num = widths[l+1];
+		layer->buffer = buffer;
+		layer->weight = (real *)buffer;
+		layer->grad = (real *)(buffer + weight_size);
+		layer->out = (real *)(buffer + weight_size*2);
+		layer->delta = (real *)(buffer + weight_size*2 + out_size);
+#ifdef MASTER_DOUBLE
+		layer->master = (double *)(buffer + weight_size*2 + out_size*2);
+#endif
+		layer->moment1 = (double *)(buffer + weight_size*2 + out_size*2 + master_size);
+		layer->moment2 = (double *)(buffer + weight_size*2 + out_size*2 + master_size + moment_size);
+		memset(layer->moment1, 0, moment_size*2);
+		layer->sparse = NULL;
+	}
+
+	net->kernel = find_small_kernel(net);
+}
+
+
+/** 作業用ネットワークの確保
+ * 重みと最適化の状態をmasterと共有し、勾配、出力、誤差信号だけを独自に持つネットワークを作る。
+ * 並列学習で各スレッドが使う。重み以外の配列は層毎に一つの連続したバッファに確保される。
+ *
+ * worker: 初期化するネットワーク。
+ * master: 重みを共有する元のネットワーク。
+ * batch_size: 一度に計算出来るパターンの最大数。
+ */
+void init_worker_network(Network *worker, const Network *master, const int batch_size){
+	int l;
+
+	worker->layer_num = master->layer_num;
+	worker->batch_size = batch_size;
+	worker->sigmoid_mode = master->sigmoid_mode;
+	worker->optimizer = master->optimizer;
+	worker->learning_rate = master->learning_rate;
+	worker->step = master->step;
+	worker->kernel = master->kernel;
+	worker->layers = malloc(sizeof(Layer) * worker->layer_num);
+
+	for(l=0; l<worker->layer_num; l++){
+		Layer *layer = &worker->layers[l];
+		const Layer *origin = &master->layers[l];
+		const size_t weight_size = align_size(sizeof(real) * origin->neuron_num * (origin->input_num + 1));
+		const size_t out_size = align_size(sizeof(real) * batch_size * origin->neuron_num);
+		char *buffer = alloc_aligned(weight_size + out_size*2);
+
+		layer->input_num = origin->input_num;
+		layer->neuron_num = origin->neuron_num;
+		layer->buffer = buffer;
+		layer->weight = origin->weight;
+#ifdef MASTER_DOUBLE
+		layer->master = origin->master;
+#endif
+		layer->moment1 = origin->moment1;
+		layer->moment2 = origin->moment2;
+		layer->sparse = NULL;  /* 枝刈りした後の学習は一つのスレッドで行なう */
+		layer->grad = (real *)buffer;
+		layer->out = (real *)(buffer + weight_size);
+		layer->delta = (real *)(buffer + weight_size + out_size);
+	}
+}
+
+
+/** ネットワークの解放
+ * init_networkで確保したメモリを解放する。
+ *
+ * net: 解放するネットワーク。
+ */
+void free_network(Network *net){
+	int l;
+
+	for(l=0; l<net->layer_num; l++){
+		const SparseWeight *sparse = net->layers[l].sparse;
 
+		if(sparse != NULL){
+			free(sparse->row);
+			free(sparse->col);
+			free(sparse->value);
+			free(net->layers[l].sparse);
+		}
+		free(net->layers[l].buffer);
+	}
+	free(net->layers);
+}
+
+
+/** 学習パターンの読み込み
+ * 引数で指定されたファイルを開き、入力データと教師データを読み込む。
+ * ファイルの各行が一つの入出力パターンに相当し、左からinput_num個が入力値、残りがoutput_num個分の教師データである。
+ * ファイルの終わりまでを全て読み込むので、パターンの数は事前に決めておく必要はない。
+ *
+ * fname: 読み込むファイルの名前。
+ * input_num: 一パターンあたりの入力値の数。
+ * output_num: 一パターンあたりの教師データの数。
+ * dataset: 読み込んだデータの保存先。dataset->dataはmallocで確保されるので、使い終わったらfreeすること。
+ */
+void read_data(
+		const char *fname,
+		const int input_num,
+		const int output_num,
+		Dataset *dataset
+){
+	const int row_size = input_num + output_num;
+	int capacity = 64, i;
+	FILE *fp;
+
+	/* ファイル fname をオープン */
+	if((fp = fopen(fname,"r")) == NULL){
+		printf("read_data(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+
+	dataset->input_num = input_num;
+	dataset->output_num = output_num;
+	dataset->pattern_num = 0;
+	dataset->mapping = NULL;
+	dataset->mapping_size = 0;
+	dataset->data = malloc(sizeof(real) * capacity * row_size);
+
+	/* 学習用データの読み込み */
+	for(;;){
+		real *row;
+		double value;
+
+		if(dataset->pattern_num >= capacity){
+			capacity *= 2;
+			dataset->data = realloc(dataset->data, sizeof(real) * capacity * row_size);
+		}
+		row = dataset->data + (size_t)dataset->pattern_num * row_size;
+
+		if(fscanf(fp, "%lf", &value) != 1){
+			break;  /* ファイルの終わり */
+		}
+		row[0] = value;
+		for(i=1; i<row_size; i++){
+			if(fscanf(fp, "%lf", &value) != 1){
+				printf("read_data(): Pattern %d in \"%s\" is too short\n", dataset->pattern_num, fname);
+				exit(1);
+			}
+			row[i] = value;
+		}
+		dataset->pattern_num++;
+	}
+
+	/* ファイルをクローズ */
+	fclose(fp);
+
+	if(dataset->pattern_num == 0){
+		printf("read_data(): \"%s\" has no pattern\n", fname);
+		exit(1);
+	}
+}
+
+
+/** バイナリ形式の学習データかどうかの判定
+ * ファイルの先頭がDATASET_MAGICかどうかでバイナリ形式の学習データかどうかを判定する。
+ *
+ * fname: 調べるファイルの名前。
+ *
+ * return: バイナリ形式なら1、そうでなければ0。
+ */
+int is_binary_data(const char *fname){
+	char magic[4];
+	FILE *fp;
+	int result;
+
+	if((fp = fopen(fname, "rb")) == NULL){
+		return 0;
+	}
+	result = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, DATASET_MAGIC, sizeof(magic)) == 0;
+	fclose(fp);
+
+	return result;
+}
+
+
+/** バイナリ形式の学習データの書き込み
+ * 読み込んだ学習データを、ヘッダとデータの行列からなるバイナリ形式でファイルに書き込む。
+ * 書き込んだファイルはmap_dataで読み込むことが出来る。
+ *
+ * fname: 書き込むファイルの名前。
+ * dataset: 書き込む学習データ。
+ */
+void write_binary_data(const char *fname, const Dataset *dataset){
+	DatasetHeader header;
+	const size_t count = (size_t)dataset->pattern_num * (dataset->input_num + dataset->output_num);
+	FILE *fp;
+
+	/* ファイル fname をオープン */
+	if((fp = fopen(fname, "wb")) == NULL){
+		printf("write_binary_data(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+	header.version = DATASET_VERSION;
+	header.input_num = dataset->input_num;
+	header.output_num = dataset->output_num;
+	header.pattern_num = dataset->pattern_num;
+	header.element_size = sizeof(real);
+
+	if(fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(dataset->data, sizeof(real), count, fp) != count){
+		printf("write_binary_data(): Cannot write \"%s\"\n", fname);
+		exit(1);
+	}
+
+	/* ファイルをクローズ */
+	fclose(fp);
+}
+
+
+/** バイナリ形式の学習データのメモリマップ
+ * write_binary_dataで書き込んだファイルをメモリマップし、データの行列を読み込まずにそのまま学習データとして使う。
+ * ファイルの内容は必要になった時点でOSによって読み込まれるので、大きなファイルでもすぐに学習を始められる。
+ *
+ * ヘッダが壊れている場合や、入力値と教師データの数がネットワークと合わない場合はエラーを表示してプログラムを終了させる。
+ * 値の型(sizeof(real))が違うプログラムで変換したファイルも読み込めない。
+ *
+ * fname: 読み込むファイルの名前。
+ * input_num: ネットワークの入力値の数。
+ * output_num: ネットワークの出力値の数。
+ * dataset: 学習データの保存先。使い終わったらfree_dataで解放すること。
+ */
+void map_data(
+		const char *fname,
+		const int input_num,
+		const int output_num,
+		Dataset *dataset
+){
+	const DatasetHeader *header;
+	struct stat st;
+	size_t data_size;
+	int fd;
+
+	/* ファイル fname をオープン */
+	if((fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) != 0){
+		printf("map_data(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+	if((size_t)st.st_size < sizeof(DatasetHeader)){
+		printf("map_data(): \"%s\" is too short\n", fname);
+		exit(1);
+	}
+
+	dataset->mapping_size = st.st_size;
+	dataset->mapping = mmap(NULL, dataset->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(dataset->mapping == MAP_FAILED){
+		printf("map_data(): Cannot map \"%s\"\n", fname);
+		exit(1);
+	}
+	close(fd);  /* マップした領域はファイルを閉じても有効 */
+
+	/* ヘッダの確認 */
+	header = dataset->mapping;
+	if(memcmp(header->magic, DATASET_MAGIC, sizeof(header->magic)) != 0
+	|| header->version != DATASET_VERSION
+	|| header->element_size != sizeof(real)){
+		printf("map_data(): \"%s\" is not a dataset for this program\n", fname);
+		exit(1);
+	}
+	if(header->input_num != input_num || header->output_num != output_num){
+		printf("map_data(): \"%s\" has %d inputs and %d outputs, but network has %d and %d\n",
+			fname, header->input_num, header->output_num, input_num, output_num);
+		exit(1);
+	}
+	data_size = sizeof(real) * (size_t)header->pattern_num * (input_num + output_num);
+	if(header->pattern_num <= 0 || (size_t)st.st_size < sizeof(DatasetHeader) + data_size){
+		printf("map_data(): \"%s\" is truncated\n", fname);
+		exit(1);
+	}
+
+	dataset->input_num = input_num;
+	dataset->output_num = output_num;
+	dataset->pattern_num = header->pattern_num;
+	dataset->data = (real *)((char *)dataset->mapping + sizeof(DatasetHeader));
+
+	/* 学習では先頭から順番に読むので、先読みをOSに頼んでおく */
+	posix_madvise(dataset->mapping, dataset->mapping_size, POSIX_MADV_SEQUENTIAL);
+}
+
+
+/** 学習データの解放
+ * read_dataかmap_dataで読み込んだ学習データを解放する。
+ *
+ * dataset: 解放する学習データ。
+ */
+void free_data(Dataset *dataset){
+	if(dataset->mapping != NULL){
+		munmap(dataset->mapping, dataset->mapping_size);
+	}else{
+		free(dataset->data);
+	}
+}
+
+
+/** テキストの読み込み器の初期化
+ * ファイルから数値を読み込むためのTextReaderを作る。
+ *
+ * reader: 初期化する読み込み器。
+ * fp: 読み込むファイル。標準入力でもよい。
+ */
+void init_reader(TextReader *reader, FILE *fp){
+	reader->fp = fp;
+	reader->buffer = malloc(READER_BUFFER_SIZE + 1);
+	reader->pos = 0;
+	reader->len = 0;
+	reader->eof = 0;
+}
+
+
+/** テキストの追加読み込み
+ * まだ読んでいない部分をバッファの先頭に詰め、空いた所にファイルの続きを読み込む。
+ *
+ * reader: 読み込み器。
+ *
+ * return: 新たに読み込んだバイト数。
+ */
+int refill_reader(TextReader *reader){
+	size_t got;
+
+	memmove(reader->buffer, reader->buffer + reader->pos, reader->len - reader->pos);
+	reader->len -= reader->pos;
+	reader->pos = 0;
+
+	got = fread(reader->buffer + reader->len, 1, READER_BUFFER_SIZE - reader->len, reader->fp);
+	reader->len += got;
+	reader->buffer[reader->len] = '\0';  /* strtodが読み過ぎないように */
+	if(got == 0){
+		reader->eof = 1;
+	}
+
+	return (int)got;
+}
+
+
+/** 数値の読み込み
+ * スペースや改行を読み飛ばし、次の数値を一つ読み込む。
+ *
+ * reader: 読み込み器。
+ * value: 読み込んだ数値の保存先。
+ *
+ * return: 読み込めたら1、ファイルの終わりか数値でないものがあれば0。
+ */
+int read_number(TextReader *reader, double *value){
+	size_t end;
+	char *parsed;
+
+	/* 空白を読み飛ばす */
+	for(;;){
+		while(reader->pos < reader->len && strchr(" \t\r\n", reader->buffer[reader->pos]) != NULL){
+			reader->pos++;
+		}
+		if(reader->pos < reader->len || reader->eof || refill_reader(reader) == 0){
+			break;
+		}
+	}
+	if(reader->pos >= reader->len){
+		return 0;
+	}
+
+	/* 数値の全体がバッファに入っていなければ続きを読み込む */
+	for(end=reader->pos; end < reader->len && strchr(" \t\r\n", reader->buffer[end]) == NULL; end++);
+	if(end >= reader->len && !reader->eof){
+		refill_reader(reader);
+	}
+
+	*value = strtod(reader->buffer + reader->pos, &parsed);
+	if(parsed == reader->buffer + reader->pos){
+		return 0;
+	}
+	reader->pos = parsed - reader->buffer;
+
+	return 1;
+}
+
+
+/** 重みの取得
+ * 層のi番目の重みを返す。MASTER_DOUBLEが定義されていれば倍精度の重みを返す。
+ *
+ * layer: 重みを持つ層。
+ * i: 重みの番号。
+ *
+ * return: 重みの値。
+ */
+double get_weight(const Layer *layer, const int i){
+#ifdef MASTER_DOUBLE
+	return layer->master[i];
+#else
+	return layer->weight[i];
+#endif
+}
+
+
+/** 重みの設定
+ * 層のi番目の重みをvalueにする。MASTER_DOUBLEが定義されていれば倍精度の重みにも設定する。
+ *
+ * layer: 重みを持つ層。
+ * i: 重みの番号。
+ * value: 設定する値。
+ */
+void set_weight(const Layer *layer, const int i, const double value){
+#ifdef MASTER_DOUBLE
+	layer->master[i] = value;
+#endif
+	layer->weight[i] = value;
+}
+
+
+/** 重みを動かす
+ * 層のi番目の重みからstepを引く。
+ * MASTER_DOUBLEが定義されていれば倍精度の重みから引き、その結果を計算用の重みに写す。
+ * 単精度では埋もれてしまうような小さなstepも、倍精度の重みには積み重なっていく。
+ *
+ * layer: 重みを持つ層。
+ * i: 重みの番号。
+ * step: 重みから引く値。
+ */
+void step_weight(const Layer *layer, const int i, const double step){
+#ifdef MASTER_DOUBLE
+	layer->master[i] -= step;
+	layer->weight[i] = layer->master[i];
+#else
+	layer->weight[i] -= step;
+#endif
+}
+
+
+/** 学習済みモデルの書き込み
+ * ネットワークの形と全ての重みをバイナリ形式でファイルに書き込む。
+ * 書き込んだファイルはload_modelで読み込むことが出来る。
+ *
+ * fname: 書き込むファイルの名前。
+ * net: 書き込むネットワーク。
+ */
+void save_model(const char *fname, const Network *net){
+	ModelHeader header;
+	FILE *fp;
+	int i, l, width;
+
+	/* ファイル fname をオープン */
+	if((fp = fopen(fname, "wb")) == NULL){
+		printf("save_model(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+	header.version = MODEL_VERSION;
+	header.layer_num = net->layer_num + 1;
+	header.element_size = sizeof(double);
+	fwrite(&header, sizeof(header), 1, fp);
+
+	/* 各層のニューロン数 */
+	fwrite(&net->layers[0].input_num, sizeof(int), 1, fp);
+	for(l=0; l<net->layer_num; l++){
+		width = net->layers[l].neuron_num;
+		fwrite(&width, sizeof(int), 1, fp);
+	}
+
+	/* 各層の重み */
+	for(l=0; l<net->layer_num; l++){
+		const Layer *layer = &net->layers[l];
+
+		for(i=0; i<layer->neuron_num * (layer->input_num+1); i++){
+			const double weight = get_weight(layer, i);
+
+			fwrite(&weight, sizeof(double), 1, fp);
+		}
+	}
+
+	/* ファイルをクローズ */
+	if(ferror(fp) || fclose(fp) != 0){
+		printf("save_model(): Cannot write \"%s\"\n", fname);
+		exit(1);
+	}
+}
+
+
+/** 学習済みモデルの読み込み
+ * save_modelで書き込んだファイルからネットワークの形と重みを読み込み、ネットワークを作る。
+ * ファイルが壊れている場合はエラーを表示してプログラムを終了させる。
+ *
+ * fname: 読み込むファイルの名前。
+ * net: 作るネットワーク。使い終わったらfree_networkで解放すること。
+ * batch_size: 一度に計算出来るパターンの最大数。
+ */
+void load_model(const char *fname, Network *net, const int batch_size){
+	ModelHeader header;
+	int *widths;
+	FILE *fp;
+	int i, l;
+
+	/* ファイル fname をオープン */
+	if((fp = fopen(fname, "rb")) == NULL){
+		printf("load_model(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+
+	if(fread(&header, sizeof(header), 1, fp) != 1
+	|| memcmp(header.magic, MODEL_MAGIC, sizeof(header.magic)) != 0
+	|| header.version != MODEL_VERSION
+	|| header.element_size != sizeof(double)
+	|| header.layer_num < 2){
+		printf("load_model(): \"%s\" is not a model for this program\n", fname);
+		exit(1);
+	}
+
+	widths = malloc(sizeof(int) * header.layer_num);
+	if(fread(widths, sizeof(int), header.layer_num, fp) != (size_t)header.layer_num){
+		printf("load_model(): \"%s\" is truncated\n", fname);
+		exit(1);
+	}
+	for(l=0; l<header.layer_num; l++){
+		if(widths[l] <= 0){
+			printf("load_model(): \"%s\" has invalid neuron number %d\n", fname, widths[l]);
+			exit(1);
+		}
+	}
+
+	init_network(net, widths, header.layer_num, batch_size);
+	for(l=0; l<net->layer_num; l++){
+		const Layer *layer = &net->layers[l];
+
+		for(i=0; i<layer->neuron_num * (layer->input_num+1); i++){
+			double weight;
+
+			if(fread(&weight, sizeof(double), 1, fp) != 1){
+				printf("load_model(): \"%s\" is truncated\n", fname);
+				exit(1);
+			}
+			set_weight(layer, i, weight);
+		}
+	}
+
+	/* ファイルをクローズ */
+	fclose(fp);
+	free(widths);
+}
+
+
+/** 重みの初期化
+ * 全ての層の重みを初期化する。
+ * 全ての重みは閾値の分も含めて-0.5から0.5までの乱数が代入される。
+ *
+ * net: 初期化するネットワーク。
+ * seed: 乱数の種。同じ種を与えれば同じ重みになる。
+ */
+void init_weight(Network *net, const unsigned int seed){
+	int i, l;
+
+	srand(seed); /* 乱数生成器の初期化 */
+
+	for(l=0; l<net->layer_num; l++){
+		const Layer *layer = &net->layers[l];
+
+		for(i=0; i<layer->neuron_num * (layer->input_num+1); i++){
+			set_weight(layer, i, ((double)rand()/RAND_MAX) - 0.5);
+		}
+	}
+}
+
+
+/** 重みの絶対値の比較
+ * qsortで重みを絶対値の小さい順に並べるための比較関数。
+ *
+ * a: 一つ目の重みへのポインタ。
+ * b: 二つ目の重みへのポインタ。
+ *
+ * return: aの絶対値の方が小さければ負、大きければ正、等しければ0。
+ */
+int magnitude_cmp(const void *a, const void *b){
+	const double x = fabs(*(const double *)a), y = fabs(*(const double *)b);
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
+/** 枝刈り
+ * 各層の重みのうち絶対値の小さいものからratioの割合を0にして取り除き、残った重みを疎な重み(SparseWeight)にまとめる。
+ * 閾値の分の重みは取り除かない。同じ絶対値の重みが境目にあれば、それらは全て残す。
+ * 残った重みの密度がSPARSE_BREAK_EVEN未満の層は、以後forward_propagationとback_propagationで疎な計算を使う。
+ * 取り除いた重みはupdate_weightで更新されても0のまま保たれる。
+ * 専用の計算(SMALL_KERNELS)は疎な重みを扱わないので使わなくなる。
+ *
+ * net: 枝刈りするネットワーク。既に枝刈りしていれば、残っている重みからさらに取り除く。
+ * ratio: 各層で取り除く重みの割合。0から1まで。
+ */
+void prune_network(Network *net, const double ratio){
+	int i, j, k, l, e;
+
+	for(l=0; l<net->layer_num; l++){
+		const Layer *layer = &net->layers[l];
+		const int size = layer->neuron_num * layer->input_num;
+		double *sorted = malloc(sizeof(double) * size);
+		double threshold;
+		SparseWeight *sparse;
+
+		for(j=0, i=0; j<layer->neuron_num; j++){
+			for(k=0; k<layer->input_num; k++){
+				sorted[i++] = get_weight(layer, j*(layer->input_num+1) + k);
+			}
+		}
+		qsort(sorted, size, sizeof(double), magnitude_cmp);
+		threshold = (int)(ratio * size) >= size ? HUGE_VAL : fabs(sorted[(int)(ratio * size)]);  /* 残す重みの絶対値の最小値 */
+		free(sorted);
+
+		if(layer->sparse == NULL){
+			sparse = net->layers[l].sparse = malloc(sizeof(SparseWeight));
+			sparse->row = malloc(sizeof(int) * (layer->neuron_num + 1));
+		}else{
+			sparse = layer->sparse;
+			free(sparse->col);
+			free(sparse->value);
+		}
+		sparse->col = malloc(sizeof(int) * (size > 0 ? size : 1));
+		sparse->value = malloc(sizeof(real) * (size > 0 ? size : 1));
+
+		e = 0;
+		for(j=0; j<layer->neuron_num; j++){
+			sparse->row[j] = e;
+			for(k=0; k<layer->input_num; k++){
+				i = j*(layer->input_num+1) + k;
+				if(get_weight(layer, i) != 0 && fabs(get_weight(layer, i)) >= threshold){
+					sparse->col[e] = k;
+					sparse->value[e] = layer->weight[i];
+					e++;
+				}else{
+					set_weight(layer, i, 0);
+					layer->moment1[i] = 0;  /* 慣性で動き出さないようにする */
+					layer->moment2[i] = 0;
+				}
+			}
+		}
+		sparse->row[layer->neuron_num] = e;
+		sparse->nnz = e;
+		sparse->use = e < SPARSE_BREAK_EVEN * size;
+	}
+
+	net->kernel = -1;
+}
+
+
+/** 疎な重みの同期
+ * 重みを更新した後で、枝刈りした層の取り除いた重みを0に戻し、残った重みの値を疎な重みに写す。
+ *
+ * layer: 枝刈りした層。
+ */
+void sync_sparse_weight(const Layer *layer){
+	const SparseWeight *sparse = layer->sparse;
+	int j, k, e;
+
+	for(j=0; j<layer->neuron_num; j++){
+		e = sparse->row[j];
+		for(k=0; k<layer->input_num; k++){
+			const int i = j*(layer->input_num+1) + k;
+
+			if(e < sparse->row[j+1] && sparse->col[e] == k){
+				sparse->value[e++] = layer->weight[i];
+			}else if(layer->weight[i] != 0){
+				set_weight(layer, i, 0);
+			}
+		}
+	}
+}
+
+
+/** 出力の計算（前向き計算）
+ * batch_size個の入力パターンをまとめて行列として扱い、全ての層の出力を計算する。
+ * 各層の内部状態は前の層の出力の行列と重みの転置との行列積として一度に計算され、それに閾値の分が加えられる。
+ * 枝刈りして疎な計算を使う層(prune_network参照)では、残った重みの分だけを計算する。
+ * 計算結果は各層のoutに格納される。
+ * net->kernelが-1でなければ、ネットワークの形に合わせた専用の計算を使う。
+ *
+ * net: 計算に使うネットワーク。
+ * input: 入力値の行列。batch_size行ある必要がある。
+ * ld_input: 入力値の行列の一行あたりの要素数。
+ * batch_size: 一度に計算するパターンの数。net->batch_size以下でなければならない。
+ */
+void forward_propagation(
+		const Network *net,
+		const real *input,
+		const int ld_input,
+		const int batch_size
+){
+	int j, l, p;
+
+	if(net->kernel >= 0){
+		SMALL_KERNELS[net->kernel].forward(net, input, ld_input, batch_size);
+		return;
+	}
+
+	for(l=0; l<net->layer_num; l++){
+		const Layer *layer = &net->layers[l];
+		const real *prev = l == 0 ? input : net->layers[l-1].out;
+		const int ld_prev = l == 0 ? ld_input : net->layers[l-1].neuron_num;
+		const int n = layer->neuron_num;
+
+		/* 内部状態を計算 (net = prev * weight^T) */
+		if(layer->sparse != NULL && layer->sparse->use){
+			sparse_gemm_nt(batch_size, n, layer->sparse, prev, ld_prev, layer->out, n);
+		}else{
+			gemm_nt(
+				batch_size, n, layer->input_num,
+				prev, ld_prev,
+				layer->weight, layer->input_num+1,
+				layer->out, n
+			);
+		}
+
+		/* 閾値の分を加える */
+		for(p=0; p<batch_size; p++){
+			for(j=0; j<n; j++){
+				layer->out[p*n + j] += layer->weight[j*(layer->input_num+1) + layer->input_num];
+			}
+		}
+
+		/* バッチ全体の出力をまとめて計算 */
+		sigmoid_array(layer->out, batch_size * n, net->sigmoid_mode);
+	}
+}
+
+
+/** 学習する（後ろ向き計算）
+ * 直前のforward_propagationで計算した各層の出力と教師信号から、batch_size個のパターンの誤差信号を行列としてまとめて計算する。
+ * 各層の誤差信号は一度だけ計算され、バッチ全体の勾配の合計が各層のgradに格納される。
+ * 重みは変更しないので、続けてupdate_weightを呼び出すこと。
+ * net->kernelが-1でなければ、ネットワークの形に合わせた専用の計算を使う。
+ *
+ * net: 学習するネットワーク。
+ * input: 入力された値の行列。
+ * ld_input: 入力値の行列の一行あたりの要素数。
+ * target: 出力されるべき値の行列。教師信号。
+ * ld_target: 教師信号の行列の一行あたりの要素数。
+ * batch_size: 一度に学習するパターンの数。
+ */
+void back_propagation(
+		const Network *net,
+		const real *input,
+		const int ld_input,
+		const real *target,
+		const int ld_target,
+		const int batch_size
+){
+	int j, l, p;
+	const Layer *last = &net->layers[net->layer_num-1];
+
+	if(net->kernel >= 0){
+		SMALL_KERNELS[net->kernel].backward(net, input, ld_input, target, ld_target, batch_size);
+		return;
+	}
+
+	/* 出力層の誤差信号を計算 */
+	for(p=0; p<batch_size; p++){
+		for(j=0; j<last->neuron_num; j++){
+			last->delta[p*last->neuron_num + j] = last->out[p*last->neuron_num + j] - target[p*ld_target + j];
+		}
+	}
+	sigmoid_grad_array(last->out, last->delta, batch_size * last->neuron_num);
+
+	for(l=net->layer_num-1; l>=0; l--){
+		const Layer *layer = &net->layers[l];
+		const real *prev = l == 0 ? input : net->layers[l-1].out;
+		const int ld_prev = l == 0 ? ld_input : net->layers[l-1].neuron_num;
+		const int n = layer->neuron_num;
+
+		/* バッチ全体の勾配を計算 (grad = delta^T * prev) */
+		if(layer->sparse != NULL && layer->sparse->use){
+			sparse_gemm_tn(n, layer->input_num, batch_size, layer->sparse, layer->delta, n, prev, ld_prev, layer->grad, layer->input_num+1);
+		}else{
+			gemm_tn(
+				n, layer->input_num, batch_size,
+				layer->delta, n,
+				prev, ld_prev,
+				layer->grad, layer->input_num+1
+			);
+		}
+		for(j=0; j<n; j++){
+			real sum = 0;
+
+			for(p=0; p<batch_size; p++){
+				sum += layer->delta[p*n + j];
+			}
+			layer->grad[j*(layer->input_num+1) + layer->input_num] = sum;  /* 閾値の分 */
+		}
+
+		/* 一つ前の層の誤差信号を計算 (prev_delta = delta * weight) */
+		if(l > 0){
+			const Layer *prev_layer = &net->layers[l-1];
+
+			if(layer->sparse != NULL && layer->sparse->use){
+				sparse_gemm_nn(batch_size, n, layer->input_num, layer->sparse, layer->delta, n, prev_layer->delta, layer->input_num);
+			}else{
+				gemm_nn(
+					batch_size, layer->input_num, n,
+					layer->delta, n,
+					layer->weight, layer->input_num+1,
+					prev_layer->delta, layer->input_num
+				);
+			}
+			sigmoid_grad_array(prev_layer->out, prev_layer->delta, batch_size * layer->input_num);
+		}
+	}
+}
+
+
+/** 重みの最適化
+ * 層のbegin番目からend-1番目までの重みを、勾配layer->gradを使ってnet->optimizerの方法で更新する。
+ * 各方法が重み毎に持つ状態はlayer->moment1とlayer->moment2に置かれ、重みと同じ番号の要素だけを読み書きする。
+ * そのため、重みの範囲を分けてしまえば複数のスレッドから同時に呼び出せる。
+ *
+ * net: 最適化の方法と学習係数を持つネットワーク。
+ * layer: 更新する層。
+ * begin: 更新する最初の重みの番号。
+ * end: 更新する最後の重みの次の番号。
+ * step: 何回目の更新か (1から数える)。adamの偏りの補正に使う。
+ */
+void optimize_weight(const Network *net, const Layer *layer, const int begin, const int end, const int step){
+	const double rate = net->learning_rate;
+	double *m = layer->moment1, *v = layer->moment2;
+	double grad, correction1, correction2;
+	int i;
+
+	switch(net->optimizer){
+	case OPTIMIZER_MOMENTUM:
+		for(i=begin; i<end; i++){
+			m[i] = MOMENTUM_COEFFICIENT * m[i] + layer->grad[i];
+			step_weight(layer, i, rate * m[i]);
+		}
+		break;
+	case OPTIMIZER_NESTEROV:
+		/* 速度で動かした先での勾配を、今の勾配と更新後の速度で近似する */
+		for(i=begin; i<end; i++){
+			grad = layer->grad[i];
+			m[i] = MOMENTUM_COEFFICIENT * m[i] + grad;
+			step_weight(layer, i, rate * (grad + MOMENTUM_COEFFICIENT * m[i]));
+		}
+		break;
+	case OPTIMIZER_RMSPROP:
+		for(i=begin; i<end; i++){
+			grad = layer->grad[i];
+			v[i] = RMSPROP_DECAY * v[i] + (1 - RMSPROP_DECAY) * grad * grad;
+			step_weight(layer, i, rate * grad / (sqrt(v[i]) + OPTIMIZER_EPSILON));
+		}
+		break;
+	case OPTIMIZER_ADAM:
+		/* 移動平均は0から始まるので、最初のうちは小さく偏る。それを補正する。 */
+		correction1 = 1 - pow(ADAM_BETA1, step);
+		correction2 = 1 - pow(ADAM_BETA2, step);
+		for(i=begin; i<end; i++){
+			grad = layer->grad[i];
+			m[i] = ADAM_BETA1 * m[i] + (1 - ADAM_BETA1) * grad;
+			v[i] = ADAM_BETA2 * v[i] + (1 - ADAM_BETA2) * grad * grad;
+			step_weight(layer, i, rate * (m[i] / correction1) / (sqrt(v[i] / correction2) + OPTIMIZER_EPSILON));
+		}
+		break;
+	default:
+		for(i=begin; i<end; i++){
+			step_weight(layer, i, rate * layer->grad[i]);
+		}
+		break;
+	}
+}
+
+
+/** 重みの更新
+ * back_propagationで計算した勾配を使って全ての層の重みを更新する。
+ * 更新の方法はnet->optimizerで選ぶ (optimize_weight参照)。
+ * 枝刈りした層は、更新した後で取り除いた重みを0に戻す。
+ *
+ * net: 更新するネットワーク。
+ */
+void update_weight(Network *net){
+	int l;
+
+	net->step++;
+	for(l=0; l<net->layer_num; l++){
+		const Layer *layer = &net->layers[l];
+
+		optimize_weight(net, layer, 0, layer->neuron_num * (layer->input_num+1), net->step);
+		if(layer->sparse != NULL){
+			sync_sparse_weight(layer);
+		}
+	}
+}
+
+
+/** 経過時間の取得
+ * ある時点からの経過時間を秒単位で返す。二回呼び出して差を取ることで処理にかかった実時間を計る。
+ * スレッドを使っていても正しく計れるように、CPU時間ではなく実時間を使う。
+ *
+ * return: 適当な時点からの経過秒数。
+ */
+double wall_time(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/** 誤差の計算
+ * 直前のforward_propagationで計算した出力層の出力と教師信号との二乗誤差の合計を計算する。
+ *
+ * net: 出力を計算したネットワーク。
+ * target: 出力されるべき値の行列。教師信号。
+ * ld_target: 教師信号の行列の一行あたりの要素数。
+ * batch_size: 計算したパターンの数。
+ *
+ * return: batch_size個のパターンの誤差の合計。
+ */
+double calc_error(const Network *net, const real *target, const int ld_target, const int batch_size){
+	const Layer *last = &net->layers[net->layer_num-1];
+	double error = 0;
+	int j, p;
+
+	for(p=0; p<batch_size; p++){
+		for(j=0; j<last->neuron_num; j++){
+			const double diff = last->out[p*last->neuron_num + j] - target[p*ld_target + j];
+
+			error += diff * diff / 2;
+		}
+	}
+
+	return error;
+}
+
+
+/** 一回の学習
+ * 学習データ全体を一回学習する。
+ * 学習データはnet->batch_size個ずつのミニバッチに分けて、バッチ毎に重みを更新する。
+ *
+ * net: 学習するネットワーク。
+ * dataset: 学習データ。
+ *
+ * return: 全パターンの誤差の合計。
+ */
+double train_epoch(Network *net, const Dataset *dataset){
+	const int row_size = dataset->input_num + dataset->output_num;
+	double error = 0.0;
+	int p, n;
+
+	for(p=0; p<dataset->pattern_num; p+=net->batch_size){
+		const real *input = dataset->data + (size_t)p*row_size;
+		const real *target = input + dataset->input_num;
+
+		n = MIN(net->batch_size, dataset->pattern_num - p);  /* 最後のバッチは端数になることがある */
+
+		forward_propagation(net, input, row_size, n);  /* 出力の計算 (前向き計算) */
+		back_propagation(net, input, row_size, target, row_size, n);  /* 出力と教師信号を元に勾配を計算 (後向き計算) */
+		update_weight(net);  /* 重みを更新 */
+
+		error += calc_error(net, target, row_size, n);  /* バッチ内の各パターンに対する誤差の計算 (errorに加算) */
+	}
+
+	return error;
+}
+
+
+/** 学習する
+ * 誤差がMINIMAL_ERROR_LEVEL以下になるか、TRAINING_COUNT_MAX回に達するまで、train_epochで学習データ全体の学習を繰り返す。
+ * 一回毎の誤差はログファイルに書き込まれる。
+ *
+ * net: 学習するネットワーク。
+ * dataset: 学習データ。
+ * log_file: 誤差を記録するログファイル。
+ * final_error: 最後の一回の誤差の保存先。
+ *
+ * return: 学習を繰り返した回数。
+ */
+int train(Network *net, const Dataset *dataset, FILE *log_file, double *final_error){
+	double error = 20.0;  /* 誤差(error)を適当な値に設定 */
+	int i;
+
+	for(i=0; i<TRAINING_COUNT_MAX && error > MINIMAL_ERROR_LEVEL; i++){
+		error = train_epoch(net, dataset);
+		fprintf(log_file, "%d %f\n", i, error);  /* 誤差(error)をファイルに書き込む */
+	}
+
+	*final_error = error;
+
+	return i;
+}
+
+
+/** 並列学習の共有情報
+ * 並列学習で全てのスレッドが共有する情報。
+ */
+typedef struct {
+	Network *net;  /* 学習するネットワーク。重みは全スレッドで共有する。 */
+	Network *workers;  /* スレッド毎の作業用ネットワーク */
+	const Dataset *dataset;  /* 学習データ */
+	int batch_size;  /* 全スレッドを合わせたミニバッチの大きさ */
+	int thread_num;  /* スレッドの数 */
+	int strategy;  /* STRATEGY_SYNCかSTRATEGY_HOGWILD */
+	int *shard_sizes;  /* STRATEGY_SYNCで、各スレッドが今のバッチで計算したパターンの数 */
+	double *errors;  /* 各スレッドが一回の学習で計算した誤差 */
+	pthread_barrier_t barrier;  /* スレッド間の同期に使うバリア */
+	FILE *log_file;  /* 誤差を記録するログファイル */
+	int count;  /* 学習を繰り返した回数 */
+	double error;  /* 最後の一回の誤差 */
+	int stop;  /* 0以外なら学習を終える */
+} TrainContext;
+
+
+/** 並列学習の各スレッドの情報
+ */
+typedef struct {
+	TrainContext *context;  /* 共有情報 */
+	int id;  /* スレッドの番号。0からthread_num-1まで。 */
+} TrainThread;
+
+
+/** 勾配の集約
+ * STRATEGY_SYNCの並列学習で、全スレッドの勾配の合計を使って重みを更新する。
+ * 重みをスレッドの数で分割し、thread_id番目の範囲だけを担当する。
+ * 合計はスレッドの番号順に行なうので、スケジューリングに関わらず結果は同じになる。
+ * 合計した勾配はcontext->netの勾配に書き込み、それを使ってoptimize_weightで重みを更新する。
+ *
+ * context: 並列学習の共有情報。
+ * thread_id: 担当するスレッドの番号。
+ * step: 何回目の更新か (1から数える)。
+ */
+void reduce_gradient(TrainContext *context, const int thread_id, const int step){
+	int i, l, t;
+
+	for(l=0; l<context->net->layer_num; l++){
+		const Layer *layer = &context->net->layers[l];
+		const int size = layer->neuron_num * (layer->input_num + 1);
+		const int begin = (int)((long)size * thread_id / context->thread_num);
+		const int end = (int)((long)size * (thread_id+1) / context->thread_num);
+
+		for(i=begin; i<end; i++){
+			double grad = 0;
+
+			for(t=0; t<context->thread_num; t++){
+				if(context->shard_sizes[t] > 0){
+					grad += context->workers[t].layers[l].grad[i];
+				}
+			}
+			layer->grad[i] = grad;
+		}
+		optimize_weight(context->net, layer, begin, end, step);
+	}
+}
+
+
+/** 並列学習のスレッド
+ * 並列学習の一つのスレッドとして、誤差が十分に小さくなるまで学習を繰り返す。
+ *
+ * STRATEGY_SYNCでは、各ミニバッチをスレッドの数で分割して勾配を計算し、全スレッドの勾配の合計で重みを一度に更新する。
+ * STRATEGY_HOGWILDでは、学習データをスレッドの数で分割し、各スレッドが自分の担当分でロックせずに共有の重みを更新する。
+ *
+ * 一回の学習が終わる度に全スレッドで同期し、番号0のスレッドが誤差の記録と終了の判定を行なう。
+ *
+ * arg: TrainThreadへのポインタ。
+ *
+ * return: 常にNULL。
+ */
+void* train_thread(void *arg){
+	const TrainThread *thread = arg;
+	TrainContext *context = thread->context;
+	Network *worker = &context->workers[thread->id];
+	const Dataset *dataset = context->dataset;
+	const int row_size = dataset->input_num + dataset->output_num;
+	const int shard_begin = (int)((long)dataset->pattern_num * thread->id / context->thread_num);
+	const int shard_end = (int)((long)dataset->pattern_num * (thread->id+1) / context->thread_num);
+	double error;
+	int step = context->net->step;  /* STRATEGY_SYNCで重みを更新した回数。全スレッドで同じ値になる。 */
+	int p, n, t;
+
+	for(;;){
+		error = 0.0;
+
+		if(context->strategy == STRATEGY_SYNC){
+			for(p=0; p<dataset->pattern_num; p+=context->batch_size){
+				const int batch = MIN(context->batch_size, dataset->pattern_num - p);
+				const int begin = p + batch * thread->id / context->thread_num;
+				const real *input = dataset->data + (size_t)begin*row_size;
+				const real *target = input + dataset->input_num;
+
+				n = p + batch * (thread->id+1) / context->thread_num - begin;
+				context->shard_sizes[thread->id] = n;
+				if(n > 0){
+					forward_propagation(worker, input, row_size, n);
+					back_propagation(worker, input, row_size, target, row_size, n);
+					error += calc_error(worker, target, row_size, n);
+				}
+
+				pthread_barrier_wait(&context->barrier);  /* 全スレッドの勾配が揃うのを待つ */
+				reduce_gradient(context, thread->id, ++step);
+				pthread_barrier_wait(&context->barrier);  /* 全ての重みが更新されるのを待つ */
+			}
+		}else{
+			for(p=shard_begin; p<shard_end; p+=worker->batch_size){
+				const real *input = dataset->data + (size_t)p*row_size;
+				const real *target = input + dataset->input_num;
+
+				n = MIN(worker->batch_size, shard_end - p);
+
+				forward_propagation(worker, input, row_size, n);
+				back_propagation(worker, input, row_size, target, row_size, n);
+				update_weight(worker);  /* 共有の重みをロックせずに更新する */
+				error += calc_error(worker, target, row_size, n);
+			}
+		}
+
+		context->errors[thread->id] = error;
+		pthread_barrier_wait(&context->barrier);
+
+		/* 番号0のスレッドが誤差を集計して終了を判定する */
+		if(thread->id == 0){
+			error = 0.0;
+			for(t=0; t<context->thread_num; t++){
+				error += context->errors[t];
+			}
+			fprintf(context->log_file, "%d %f\n", context->count, error);  /* 誤差(error)をファイルに書き込む */
+
+			context->count++;
+			context->error = error;
+			context->stop = context->count >= TRAINING_COUNT_MAX || error <= MINIMAL_ERROR_LEVEL;
+		}
+		pthread_barrier_wait(&context->barrier);
+
+		if(context->stop){
+			break;
+		}
+	}
+
+	if(thread->id == 0 && context->strategy == STRATEGY_SYNC){
+		context->net->step = step;  /* 続けて学習するときにadamの補正が合うようにする */
+	}
+
+	return NULL;
+}
+
+
+/** 並列に学習する
+ * thread_num個のスレッドで学習データを分担して、trainと同じ条件で学習を繰り返す。
+ * 分担の方法はstrategyで指定する (train_thread参照)。
+ *
+ * STRATEGY_SYNCではnet->batch_sizeが全スレッド合わせたミニバッチの大きさになり、結果はスレッドの数と乱数の種が同じなら常に同じになる。
+ * STRATEGY_HOGWILDではnet->batch_sizeが各スレッドのミニバッチの大きさになり、スレッドの実行順によって結果が変わる。
+ *
+ * net: 学習するネットワーク。
+ * dataset: 学習データ。
+ * thread_num: スレッドの数。
+ * strategy: STRATEGY_SYNCかSTRATEGY_HOGWILD。
+ * log_file: 誤差を記録するログファイル。
+ * final_error: 最後の一回の誤差の保存先。
+ *
+ * return: 学習を繰り返した回数。
+ */
+int train_parallel(
+		Network *net,
+		const Dataset *dataset,
+		const int thread_num,
+		const int strategy,
+		FILE *log_file,
+		double *final_error
+){
+	TrainContext context;
+	TrainThread *threads = malloc(sizeof(TrainThread) * thread_num);
+	pthread_t *ids = malloc(sizeof(pthread_t) * thread_num);
+	const int worker_batch = strategy == STRATEGY_SYNC ? (net->batch_size + thread_num - 1) / thread_num : net->batch_size;
+	int t;
+
+	context.net = net;
+	context.workers = malloc(sizeof(Network) * thread_num);
+	context.dataset = dataset;
+	context.batch_size = net->batch_size;
+	context.thread_num = thread_num;
+	context.strategy = strategy;
+	context.shard_sizes = calloc(thread_num, sizeof(int));
+	context.errors = calloc(thread_num, sizeof(double));
+	context.log_file = log_file;
+	context.count = 0;
+	context.stop = 0;
+	pthread_barrier_init(&context.barrier, NULL, thread_num);
+
+	for(t=0; t<thread_num; t++){
+		init_worker_network(&context.workers[t], net, worker_batch);
+		threads[t].context = &context;
+		threads[t].id = t;
+	}
+
+	/* 番号0のスレッドは呼び出したスレッドでそのまま実行する */
+	for(t=1; t<thread_num; t++){
+		if(pthread_create(&ids[t], NULL, train_thread, &threads[t]) != 0){
+			printf("train_parallel(): Cannot create thread\n");
+			exit(1);
+		}
+	}
+	train_thread(&threads[0]);
+	for(t=1; t<thread_num; t++){
+		pthread_join(ids[t], NULL);
+	}
+
+	for(t=0; t<thread_num; t++){
+		free_network(&context.workers[t]);
+	}
+	pthread_barrier_destroy(&context.barrier);
+	free(context.workers);
+	free(context.shard_sizes);
+	free(context.errors);
+	free(threads);
+	free(ids);
+
+	*final_error = context.error;
+
+	return context.count;
+}
+
+
+/** 多重学習の複製
+ * 多重学習で、異なる乱数の種で初期化して独立に学習する一つのネットワークとその結果。
+ */
+typedef struct {
+	Network net;  /* 学習するネットワーク */
+	unsigned int seed;  /* 重みの初期化に使った乱数の種 */
+	FILE *log_file;  /* この複製の誤差を記録する一時ファイル */
+	int count;  /* 学習を繰り返した回数 */
+	double error;  /* 最後に確かめたときの誤差 */
+	int running;  /* 学習中なら0以外 */
+	const char *result;  /* 学習を終えた理由 */
+} Replica;
+
+
+/** 多重学習の共有情報
+ * 多重学習で全てのスレッドが共有する情報。複製の学習の状況とsolved_countはlockを取ってから読み書きする。
+ */
+typedef struct {
+	Replica *replicas;  /* 各複製 */
+	int replica_num;  /* 複製の数 */
+	const Dataset *dataset;  /* 学習データ */
+	int prune;  /* 0以外なら見込みの無い複製を途中で打ち切る */
+	int solved_count;  /* 誤差がMINIMAL_ERROR_LEVEL以下になった複製の中で最も少ない学習回数。まだ無ければINT_MAX。 */
+	pthread_mutex_t lock;  /* 共有情報を守るロック */
+} RestartContext;
+
+
+/** 多重学習の各スレッドの情報
+ */
+typedef struct {
+	RestartContext *context;  /* 共有情報 */
+	int id;  /* 担当する複製の番号 */
+} RestartThread;
+
+
+/** 多重学習のスレッド
+ * 一つの複製をtrainと同じ条件で学習しながら、REPLICA_CHECK_INTERVAL回毎に他の複製の状況を確かめて打ち切りを判定する。
+ *
+ * 他の複製が目標の誤差に達していれば、その学習回数を超えた時点で打ち切る。
+ * それより少ない回数で目標に達する可能性がある間は続けるので、最も早く目標に達する複製はスケジューリングに関わらず決まる。
+ * context->pruneが0以外なら、誤差が停滞していて最良の複製のREPLICA_HOPELESS_RATIO倍以上である複製も打ち切る。
+ *
+ * arg: RestartThreadへのポインタ。
+ *
+ * return: 常にNULL。
+ */
+void* restart_thread(void *arg){
+	const RestartThread *thread = arg;
+	RestartContext *context = thread->context;
+	Replica *replica = &context->replicas[thread->id];
+	double error = 20.0;  /* 誤差(error)を適当な値に設定 */
+	double checked_error = error;  /* 前回確かめたときの誤差 */
+	double best;  /* 学習中の複製の最小の誤差 */
+	int i, r, running, stop = 0;
+
+	for(i=0; i<TRAINING_COUNT_MAX && !stop; i++){
+		error = train_epoch(&replica->net, context->dataset);
+		fprintf(replica->log_file, "%d %f\n", i, error);  /* 誤差(error)をファイルに書き込む */
+
+		if(error > MINIMAL_ERROR_LEVEL && (i+1) % REPLICA_CHECK_INTERVAL != 0){
+			continue;
+		}
+
+		pthread_mutex_lock(&context->lock);
+		replica->error = error;
+		if(error <= MINIMAL_ERROR_LEVEL){
+			replica->result = "target reached";
+			context->solved_count = MIN(context->solved_count, i+1);
+			stop = 1;
+		}else if(i+1 >= context->solved_count){
+			replica->result = "stopped";
+			stop = 1;
+		}else if(context->prune && error > checked_error * REPLICA_STALL_RATIO){
+			best = error;
+			running = 0;
+			for(r=0; r<context->replica_num; r++){
+				if(context->replicas[r].running){
+					best = MIN(best, context->replicas[r].error);
+					running++;
+				}
+			}
+			if(running > 1 && error >= best * REPLICA_HOPELESS_RATIO){
+				replica->result = "pruned";
+				stop = 1;
+			}
+		}
+		replica->running = !stop;
+		pthread_mutex_unlock(&context->lock);
+
+		checked_error = error;
+	}
+
+	pthread_mutex_lock(&context->lock);
+	replica->count = i;
+	replica->error = error;
+	replica->running = 0;
+	if(!stop){
+		replica->result = "target not reached";
+	}
+	pthread_mutex_unlock(&context->lock);
+
+	return NULL;
+}
+
+
+/** 多重に学習する
+ * 乱数の種だけが違うreplica_num個の複製をそれぞれのスレッドで同時に学習し、最も良い複製を残す。
+ * 初期値によって局所解に捕まることがあっても、どれか一つが抜け出せれば良い。
+ *
+ * 一つ目の複製はnetそのもので、重みは初期化済みのものをそのまま使う。
+ * 残りの複製はnetと同じ形と設定で作り、seed+1、seed+2、…の種で重みを初期化する。
+ * 目標の誤差に達した複製があれば最も少ない学習回数で達したものを、無ければ誤差が最も小さいものを残す (restart_thread参照)。
+ * 残した複製の重みと誤差のログをnetとlog_fileに移し、他の複製は解放する。
+ * 各複製の結果は標準エラー出力に表示する。
+ *
+ * net: 学習するネットワーク。学習を終えると、残した複製に置き換わる。
+ * dataset: 学習データ。
+ * replica_num: 複製の数。
+ * seed: netの重みの初期化に使った乱数の種。
+ * prune: 0以外なら見込みの無い複製を途中で打ち切る。打ち切りはスケジューリングに依存するので、再現性が必要なら0にする。
+ * log_file: 残した複製の誤差を記録するログファイル。
+ * final_error: 残した複製の最後の一回の誤差の保存先。
+ *
+ * return: 残した複製が学習を繰り返した回数。
+ */
+int train_restart(
+		Network *net,
+		const Dataset *dataset,
+		const int replica_num,
+		const unsigned int seed,
+		const int prune,
+		FILE *log_file,
+		double *final_error
+){
+	RestartContext context;
+	RestartThread *threads = malloc(sizeof(RestartThread) * replica_num);
+	pthread_t *ids = malloc(sizeof(pthread_t) * replica_num);
+	int *widths = malloc(sizeof(int) * (net->layer_num + 1));
+	int best = 0, r, c;
+
+	widths[0] = net->layers[0].input_num;
+	for(r=0; r<net->layer_num; r++){
+		widths[r+1] = net->layers[r].neuron_num;
+	}
+
+	context.replicas = malloc(sizeof(Replica) * replica_num);
+	context.replica_num = replica_num;
+	context.dataset = dataset;
+	context.prune = prune;
+	context.solved_count = INT_MAX;
+	pthread_mutex_init(&context.lock, NULL);
+
+	/* 乱数生成器はスレッドで共有されるので、重みの初期化はスレッドを作る前に済ませる */
+	for(r=0; r<replica_num; r++){
+		Replica *replica = &context.replicas[r];
+
+		if(r == 0){
+			replica->net = *net;
+		}else{
+			init_network(&replica->net, widths, net->layer_num + 1, net->batch_size);
+			replica->net.sigmoid_mode = net->sigmoid_mode;
+			replica->net.optimizer = net->optimizer;
+			replica->net.learning_rate = net->learning_rate;
+			replica->net.kernel = net->kernel;
+			init_weight(&replica->net, seed + r);
+		}
+		if((replica->log_file = tmpfile()) == NULL){
+			printf("train_restart(): Cannot open temporary file\n");
+			exit(1);
+		}
+		replica->seed = seed + r;
+		replica->count = 0;
+		replica->error = HUGE_VAL;
+		replica->running = 1;
+		replica->result = NULL;
+		threads[r].context = &context;
+		threads[r].id = r;
+	}
+
+	/* 番号0の複製は呼び出したスレッドでそのまま学習する */
+	for(r=1; r<replica_num; r++){
+		if(pthread_create(&ids[r], NULL, restart_thread, &threads[r]) != 0){
+			printf("train_restart(): Cannot create thread\n");
+			exit(1);
+		}
+	}
+	restart_thread(&threads[0]);
+	for(r=1; r<replica_num; r++){
+		pthread_join(ids[r], NULL);
+	}
+
+	/* 残す複製を選ぶ */
+	for(r=0; r<replica_num; r++){
+		const Replica *replica = &context.replicas[r];
+		const Replica *current = &context.replicas[best];
+		const int reached = replica->error <= MINIMAL_ERROR_LEVEL;
+		const int current_reached = current->error <= MINIMAL_ERROR_LEVEL;
+
+		if(reached != current_reached ? reached : (reached ? replica->count < current->count : replica->error < current->error)){
+			best = r;
+		}
+	}
+
+	for(r=0; r<replica_num; r++){
+		Replica *replica = &context.replicas[r];
+
+		fprintf(stderr, "replica %d: seed: %u, epochs: %d, error: %g (%s)%s\n",
+			r, replica->seed, replica->count, replica->error, replica->result, r == best ? " *" : "");
+
+		if(r == best){
+			/* 残した複製の誤差のログを移す */
+			rewind(replica->log_file);
+			while((c = getc(replica->log_file)) != EOF){
+				putc(c, log_file);
+			}
+			*net = replica->net;
+		}else{
+			free_network(&replica->net);
+		}
+		fclose(replica->log_file);
+	}
+
+	*final_error = context.replicas[best].error;
+	r = context.replicas[best].count;
+
+	pthread_mutex_destroy(&context.lock);
+	free(context.replicas);
+	free(threads);
+	free(ids);
+	free(widths);
+
+	return r;
+}
+
+
+/** 逐次学習の読み込み待ち行列
+ * 逐次学習で、読み込みスレッドが読み込んだパターンをチャンク単位で学習するスレッドに渡すための環状の待ち行列。
+ * 読み込みと学習は別のスレッドで同時に進み、溜められるチャンクはSTREAM_QUEUE_SIZE個までなので、メモリの使用量は入力の長さによらない。
+ */
+typedef struct {
+	TextReader reader;  /* 入力の読み込み器 */
+	int row_size;  /* 一パターンあたりの数値の数 (入力値と教師データ) */
+	real *chunks;  /* STREAM_QUEUE_SIZE個のチャンク。各チャンクはSTREAM_CHUNK_SIZE行row_size列。 */
+	int chunk_sizes[STREAM_QUEUE_SIZE];  /* 各チャンクに入っているパターンの数 */
+	long head;  /* 次に学習するチャンクの通し番号 */
+	long tail;  /* 次に読み込むチャンクの通し番号 */
+	int eof;  /* 入力を最後まで読んだら0以外 */
+	pthread_mutex_t lock;  /* 以上を守るロック */
+	pthread_cond_t filled;  /* チャンクが読み込まれたことの通知 */
+	pthread_cond_t emptied;  /* チャンクが空いたことの通知 */
+} StreamQueue;
+
+
+/** 逐次学習の読み込みスレッド
+ * 入力の終わりまでパターンを読み込み、STREAM_CHUNK_SIZE個ずつ待ち行列に入れる。
+ * 待ち行列が一杯なら、学習するスレッドがチャンクを空けるまで待つ。
+ *
+ * arg: StreamQueueへのポインタ。
+ *
+ * return: 常にNULL。
+ */
+void* stream_reader_thread(void *arg){
+	StreamQueue *queue = arg;
+	real *chunk;
+	double value;
+	int n, k, eof = 0;
+
+	while(!eof){
+		pthread_mutex_lock(&queue->lock);
+		while(queue->tail - queue->head >= STREAM_QUEUE_SIZE){
+			pthread_cond_wait(&queue->emptied, &queue->lock);
+		}
+		pthread_mutex_unlock(&queue->lock);
+
+		/* 空いたチャンクには他のスレッドが触らないので、ロックせずに読み込む */
+		chunk = queue->chunks + (size_t)(queue->tail % STREAM_QUEUE_SIZE) * STREAM_CHUNK_SIZE * queue->row_size;
+		for(n=0; n<STREAM_CHUNK_SIZE; n++){
+			if(read_number(&queue->reader, &value) == 0){
+				eof = 1;
+				break;
+			}
+			chunk[n*queue->row_size] = value;
+			for(k=1; k<queue->row_size; k++){
+				if(read_number(&queue->reader, &value) == 0){
+					printf("stream_reader_thread(): Pattern %ld is too short\n", queue->tail * STREAM_CHUNK_SIZE + n);
+					exit(1);
+				}
+				chunk[n*queue->row_size + k] = value;
+			}
+		}
+
+		pthread_mutex_lock(&queue->lock);
+		queue->chunk_sizes[queue->tail % STREAM_QUEUE_SIZE] = n;
+		queue->tail++;
+		queue->eof = eof;
+		pthread_cond_signal(&queue->filled);
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	return NULL;
+}
+
+
+/** 重みの書き出し
+ * 学習途中の重みを学習済みモデルとして書き出す。
+ * 一旦別の名前で書き込んでから名前を変えるので、読み込む側が書きかけのファイルを見ることはない。
+ *
+ * fname: 書き込むファイルの名前。
+ * net: 書き込むネットワーク。
+ */
+void save_snapshot(const char *fname, const Network *net){
+	char *temp = malloc(strlen(fname) + 5);
+
+	sprintf(temp, "%s.tmp", fname);
+	save_model(temp, net);
+	if(rename(temp, fname) != 0){
+		printf("save_snapshot(): Cannot rename \"%s\" to \"%s\"\n", temp, fname);
+		exit(1);
+	}
+	free(temp);
+}
+
+
+/** 逐次学習する
+ * 入力の終わりまで、届いたパターンをnet->batch_size個ずつのミニバッチにして順に一度だけ学習する。
+ * 読み込みは別のスレッド(stream_reader_thread)で行なうので、読み込みと学習は同時に進む。
+ *
+ * 学習したパターンは最大REPLAY_BUFFER_SIZE個まで環状のバッファに取っておき、古いものから上書きする。
+ * 新しいミニバッチを一つ学習する度に、そこから無作為に選んだパターンでREPLAY_BATCH_NUM個のミニバッチを学習する。
+ * 最近のパターンだけに合わせて過去に学習したことを忘れてしまうのを防ぐためである。
+ *
+ * チャンク毎に新しいパターンの一パターンあたりの誤差をログファイルに書き込み、
+ * snapshot_fileがNULLでなければSNAPSHOT_INTERVAL個のパターン毎と最後に重みを書き出す。
+ *
+ * net: 学習するネットワーク。
+ * fname: 入力のファイル名。NULLか"-"なら標準入力から読み込む。
+ * snapshot_file: 重みを書き出すファイルの名前。NULLなら書き出さない。
+ * log_file: 誤差を記録するログファイル。
+ * final_error: 最後のチャンクの一パターンあたりの誤差の保存先。
+ *
+ * return: 学習したパターンの数。
+ */
+long train_stream(Network *net, const char *fname, const char *snapshot_file, FILE *log_file, double *final_error){
+	StreamQueue queue;
+	pthread_t reader_thread;
+	FILE *fp = stdin;
+	const int row_size = net->layers[0].input_num + net->layers[net->layer_num-1].neuron_num;
+	const int input_num = net->layers[0].input_num;
+	real *replay = alloc_aligned(sizeof(real) * REPLAY_BUFFER_SIZE * row_size);  /* 取っておいたパターン */
+	real *sample = alloc_aligned(sizeof(real) * net->batch_size * row_size);  /* 取っておいたパターンから選んだミニバッチ */
+	long replay_count = 0;  /* 今までに取っておいたパターンの数 (上書きした分も含む) */
+	long count = 0;  /* 学習したパターンの数 */
+	double error = 0.0;
+	int chunk_size, p, n, r, i;
+
+	if(fname != NULL && strcmp(fname, "-") != 0 && (fp = fopen(fname, "r")) == NULL){
+		printf("train_stream(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+	init_reader(&queue.reader, fp);
+	queue.row_size = row_size;
+	queue.chunks = alloc_aligned(sizeof(real) * STREAM_QUEUE_SIZE * STREAM_CHUNK_SIZE * row_size);
+	queue.head = 0;
+	queue.tail = 0;
+	queue.eof = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.filled, NULL);
+	pthread_cond_init(&queue.emptied, NULL);
+
+	if(pthread_create(&reader_thread, NULL, stream_reader_thread, &queue) != 0){
+		printf("train_stream(): Cannot create thread\n");
+		exit(1);
+	}
+
+	for(;;){
+		const real *chunk = queue.chunks + (size_t)(queue.head % STREAM_QUEUE_SIZE) * STREAM_CHUNK_SIZE * row_size;
+
+		pthread_mutex_lock(&queue.lock);
+		while(queue.head == queue.tail){
+			pthread_cond_wait(&queue.filled, &queue.lock);
+		}
+		chunk_size = queue.chunk_sizes[queue.head % STREAM_QUEUE_SIZE];
+		pthread_mutex_unlock(&queue.lock);
+
+		if(chunk_size > 0){
+			error = 0.0;
+		}
+		for(p=0; p<chunk_size; p+=n){
+			const real *input = chunk + (size_t)p*row_size;
+
+			n = MIN(net->batch_size, chunk_size - p);
+
+			/* 新しいパターンを学習する */
+			forward_propagation(net, input, row_size, n);
+			back_propagation(net, input, row_size, input + input_num, row_size, n);
+			update_weight(net);
+			error += calc_error(net, input + input_num, row_size, n);
+
+			/* 取っておいたパターンから選んで学習する */
+			for(r=0; r<REPLAY_BATCH_NUM && replay_count > 0; r++){
+				for(i=0; i<n; i++){
+					const long index = (long)((double)rand() / ((double)RAND_MAX + 1) * MIN(replay_count, REPLAY_BUFFER_SIZE));
+
+					memcpy(sample + (size_t)i*row_size, replay + (size_t)index*row_size, sizeof(real) * row_size);
+				}
+				forward_propagation(net, sample, row_size, n);
+				back_propagation(net, sample, row_size, sample + input_num, row_size, n);
+				update_weight(net);
+			}
+
+			/* 新しいパターンを取っておく */
+			for(i=0; i<n; i++){
+				memcpy(replay + (size_t)(replay_count % REPLAY_BUFFER_SIZE)*row_size, input + (size_t)i*row_size, sizeof(real) * row_size);
+				replay_count++;
+			}
+
+			if(snapshot_file != NULL && (count + n) / SNAPSHOT_INTERVAL != count / SNAPSHOT_INTERVAL){
+				save_snapshot(snapshot_file, net);
+			}
+			count += n;
+		}
+		if(chunk_size > 0){
+			error /= chunk_size;
+			fprintf(log_file, "%ld %f\n", count, error);  /* 誤差(error)をファイルに書き込む */
+		}
+
+		/* チャンクを空けて読み込みスレッドに返す */
+		pthread_mutex_lock(&queue.lock);
+		queue.head++;
+		pthread_cond_signal(&queue.emptied);
+		if(queue.eof && queue.head == queue.tail){
+			pthread_mutex_unlock(&queue.lock);
+			break;
+		}
+		pthread_mutex_unlock(&queue.lock);
+	}
+	pthread_join(reader_thread, NULL);
+
+	if(snapshot_file != NULL){
+		save_snapshot(snapshot_file, net);
+	}
+
+	if(fp != stdin){
+		fclose(fp);
+	}
+	pthread_mutex_destroy(&queue.lock);
+	pthread_cond_destroy(&queue.filled);
+	pthread_cond_destroy(&queue.emptied);
+	free(queue.reader.buffer);
+	free(queue.chunks);
+	free(replay);
+	free(sample);
+
+	*final_error = error;
+
+	return count;
+}
+
+
+/** 量子化した層
+ * 一つの層の重みをint8に量子化したもの。重みは w ≒ weight * scale で元に戻る。
+ * 閾値の分は量子化せずに持つ。
+ */
+typedef struct {
+	int input_num;  /* この層への入力の数 */
+	int neuron_num;  /* この層のニューロン数 */
+	int stride;  /* 重みと入力の一行の要素数。input_numをQUANT_BLOCK_SIZEの倍数に切り上げたもの。余りは0で埋める。 */
+	float scale;  /* 重みの量子化の刻み。重みの絶対値の最大値をQUANT_MAXで割ったもの。 */
+	signed char *weight;  /* 量子化した重み。neuron_num行stride列。 */
+	real *bias;  /* 閾値の分の重み。neuron_num個。 */
+	signed char *input;  /* この層への入力を量子化したもの。batch_size行stride列。 */
+} QuantizedLayer;
+
+
+/** 量子化したネットワーク
+ * 推論だけに使う、重みと中間層の出力をint8に量子化したネットワーク。
+ * ネットワークへの入力はパターン毎に絶対値の最大値で刻みを決めて量子化する。
+ * 中間層の出力はシグモイド関数の値で0から1までなので、刻みは常に1/QUANT_MAXである。
+ */
+typedef struct {
+	int layer_num;  /* 層の数 (入力層は含まない) */
+	int batch_size;  /* 一度に計算出来るパターンの最大数 */
+	QuantizedLayer *layers;  /* 各層 */
+	real *input_scale;  /* 各パターンの入力の量子化の刻み。batch_size個。 */
+	real *out;  /* 出力層の出力。batch_size行neuron_num列。 */
+	float sigmoid_table[SIGMOID_TABLE_SIZE];  /* ±SIGMOID_TABLE_RANGEを等間隔に分けた点でのシグモイド関数の値 */
+} QuantizedNetwork;
+
+
+/** int8への量子化
+ * 値xを刻みscaleで量子化し、-QUANT_MAXからQUANT_MAXまでの整数に丸める。
+ *
+ * x: 量子化する値。
+ * scale: 量子化の刻み。
+ *
+ * return: 量子化した値。
+ */
+int quantize_value(const double x, const double scale){
+	const double q = floor(x / scale + 0.5);
+
+	return q > QUANT_MAX ? QUANT_MAX : (q < -QUANT_MAX ? -QUANT_MAX : (int)q);
+}
+
+
+/** int8の内積
+ * int8の配列aとbの内積をint32で計算する。
+ * AVX2かSSE2が使えれば、16個ずつint16に広げて積和命令(pmaddwd)でまとめて計算する。
+ *
+ * a: 一つ目の配列。
+ * b: 二つ目の配列。
+ * n: 配列の要素数。QUANT_BLOCK_SIZEの倍数である必要がある。
+ *
+ * return: 内積。
+ */
+int dot_int8(const signed char *a, const signed char *b, const int n){
+	int sum = 0, i = 0;
+
+#if defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+	__m128i s;
+
+	for(; i+16<=n; i+=16){
+		const __m256i x = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+		const __m256i y = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(x, y));
+	}
+	s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+	sum = _mm_cvtsi128_si32(s);
+#elif defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+
+	for(; i+16<=n; i+=16){
+		const __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		const __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		/* 自分自身と交互に並べてから右に算術シフトすると、符号を保ったままint16に広がる */
+		const __m128i x_lo = _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8), x_hi = _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+		const __m128i y_lo = _mm_srai_epi16(_mm_unpacklo_epi8(y, y), 8), y_hi = _mm_srai_epi16(_mm_unpackhi_epi8(y, y), 8);
+
+		acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(x_lo, y_lo), _mm_madd_epi16(x_hi, y_hi)));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+	sum = _mm_cvtsi128_si32(acc);
+#endif
+
+	for(; i<n; i++){
+		sum += a[i] * b[i];
+	}
+
+	return sum;
+}
+
+
+/** ネットワークの量子化
+ * 学習済みのネットワークの重みを層毎の刻みでint8に量子化し、推論用のネットワークを作る。
+ * シグモイド関数の表もここで作る。元のネットワークは変更しない。
+ *
+ * quant: 作成する量子化したネットワーク。使い終わったらfree_quantized_networkで解放すること。
+ * net: 量子化する学習済みのネットワーク。
+ * batch_size: 一度に計算出来るパターンの最大数。
+ */
+void quantize_network(QuantizedNetwork *quant, const Network *net, const int batch_size){
+	int i, j, k, l;
+	double max;
+
+	quant->layer_num = net->layer_num;
+	quant->batch_size = batch_size;
+	quant->layers = malloc(sizeof(QuantizedLayer) * net->layer_num);
+	quant->input_scale = alloc_aligned(sizeof(real) * batch_size);
+	quant->out = alloc_aligned(sizeof(real) * batch_size * net->layers[net->layer_num-1].neuron_num);
+
+	for(l=0; l<net->layer_num; l++){
+		const Layer *layer = &net->layers[l];
+		QuantizedLayer *q = &quant->layers[l];
+
+		q->input_num = layer->input_num;
+		q->neuron_num = layer->neuron_num;
+		q->stride = (layer->input_num + QUANT_BLOCK_SIZE - 1) / QUANT_BLOCK_SIZE * QUANT_BLOCK_SIZE;
+		q->weight = alloc_aligned((size_t)q->neuron_num * q->stride);
+		q->bias = alloc_aligned(sizeof(real) * q->neuron_num);
+		q->input = alloc_aligned((size_t)batch_size * q->stride);
+		memset(q->weight, 0, (size_t)q->neuron_num * q->stride);
+		memset(q->input, 0, (size_t)batch_size * q->stride);  /* 余りの部分は以後も0のまま */
+
+		max = 0;
+		for(j=0; j<q->neuron_num; j++){
+			for(k=0; k<q->input_num; k++){
+				max = fabs(get_weight(layer, j*(q->input_num+1) + k)) > max ? fabs(get_weight(layer, j*(q->input_num+1) + k)) : max;
+			}
+		}
+		q->scale = max > 0 ? max / QUANT_MAX : 1;
+
+		for(j=0; j<q->neuron_num; j++){
+			for(k=0; k<q->input_num; k++){
+				q->weight[j*q->stride + k] = quantize_value(get_weight(layer, j*(q->input_num+1) + k), q->scale);
+			}
+			q->bias[j] = get_weight(layer, j*(q->input_num+1) + q->input_num);
+		}
+	}
+
+	for(i=0; i<SIGMOID_TABLE_SIZE; i++){
+		quant->sigmoid_table[i] = sigmoid_func(-SIGMOID_TABLE_RANGE + 2*SIGMOID_TABLE_RANGE * i / (SIGMOID_TABLE_SIZE - 1));
+	}
+}
+
+
+/** 量子化したネットワークの解放
+ * quantize_networkで確保したメモリを解放する。
+ *
+ * quant: 解放するネットワーク。
+ */
+void free_quantized_network(QuantizedNetwork *quant){
+	int l;
+
+	for(l=0; l<quant->layer_num; l++){
+		free(quant->layers[l].weight);
+		free(quant->layers[l].bias);
+		free(quant->layers[l].input);
+	}
+	free(quant->layers);
+	free(quant->input_scale);
+	free(quant->out);
+}
+
+
+/** 量子化した出力の計算
+ * 量子化したネットワークでbatch_size個の入力パターンの出力を計算する。
+ * 各ニューロンの内部状態はint8の内積(dot_int8)を刻みで戻して閾値を加えたもので、シグモイド関数は表を引いて求める。
+ * 中間層の出力はint8に量子化して次の層に渡す。
+ *
+ * quant: 計算に使う量子化したネットワーク。
+ * input: 入力値の行列。batch_size行ある必要がある。
+ * ld_input: 入力値の行列の一行あたりの要素数。
+ * batch_size: 一度に計算するパターンの数。quant->batch_size以下でなければならない。
+ */
+void quantized_propagation(
+		const QuantizedNetwork *quant,
+		const real *input,
+		const int ld_input,
+		const int batch_size
+){
+	const QuantizedLayer *first = &quant->layers[0];
+	const double table_step = (SIGMOID_TABLE_SIZE - 1) / (2 * SIGMOID_TABLE_RANGE);
+	double max, scale, x;
+	int j, k, l, p, index;
+
+	/* 入力をパターン毎の刻みで量子化する */
+	for(p=0; p<batch_size; p++){
+		const real *row = input + (size_t)p*ld_input;
+
+		max = 0;
+		for(k=0; k<first->input_num; k++){
+			max = fabs(row[k]) > max ? fabs(row[k]) : max;
+		}
+		quant->input_scale[p] = max > 0 ? max / QUANT_MAX : 1;
+		for(k=0; k<first->input_num; k++){
+			first->input[p*first->stride + k] = quantize_value(row[k], quant->input_scale[p]);
+		}
+	}
+
+	for(l=0; l<quant->layer_num; l++){
+		const QuantizedLayer *layer = &quant->layers[l];
+		const QuantizedLayer *next = l+1 < quant->layer_num ? &quant->layers[l+1] : NULL;
+
+		for(p=0; p<batch_size; p++){
+			scale = layer->scale * (l == 0 ? quant->input_scale[p] : 1.0 / QUANT_MAX);
+
+			for(j=0; j<layer->neuron_num; j++){
+				x = dot_int8(layer->input + p*layer->stride, layer->weight + j*layer->stride, layer->stride) * scale + layer->bias[j];
+
+				/* 表の範囲に丸めてから添字にする (NaNは-SIGMOID_TABLE_RANGEになる) */
+				x = x > -SIGMOID_TABLE_RANGE ? (x < SIGMOID_TABLE_RANGE ? x : SIGMOID_TABLE_RANGE) : -SIGMOID_TABLE_RANGE;
+				index = (int)((x + SIGMOID_TABLE_RANGE) * table_step + 0.5);
+
+				if(next != NULL){
+					next->input[p*next->stride + j] = (signed char)(quant->sigmoid_table[index] * QUANT_MAX + 0.5);
+				}else{
+					quant->out[p*layer->neuron_num + j] = quant->sigmoid_table[index];
+				}
+			}
+		}
+	}
+}
+
+
+/** 量子化の精度の報告
+ * 学習データの全パターンについて、元のネットワークと量子化したネットワークの出力を比べて標準エラー出力に表示する。
+ * 表示するのは出力の差の最大値と平均、それぞれのスコア、0.5を閾値とした分類が一致した割合である。
+ *
+ * net: 元のネットワーク。
+ * quant: netを量子化したネットワーク。
+ * dataset: 比べるのに使う学習データ。
+ */
+void report_quantization(const Network *net, const QuantizedNetwork *quant, const Dataset *dataset){
+	const Layer *last = &net->layers[net->layer_num-1];
+	const int row_size = dataset->input_num + dataset->output_num;
+	const int batch = MIN(net->batch_size, quant->batch_size);
+	double diff, max_diff = 0, sum_diff = 0, score = 0, quant_score = 0;
+	long agree = 0;
+	int i, n, p;
+
+	for(p=0; p<dataset->pattern_num; p+=n){
+		const real *input = dataset->data + (size_t)p*row_size;
+
+		n = MIN(batch, dataset->pattern_num - p);
+		forward_propagation(net, input, row_size, n);
+		quantized_propagation(quant, input, row_size, n);
+
+		for(i=0; i<n*dataset->output_num; i++){
+			const double target = input[(i / dataset->output_num) * row_size + dataset->input_num + i % dataset->output_num];
+
+			diff = fabs(last->out[i] - quant->out[i]);
+			max_diff = diff > max_diff ? diff : max_diff;
+			sum_diff += diff;
+			score += fabs(target - last->out[i]);
+			quant_score += fabs(target - quant->out[i]);
+			agree += (last->out[i] >= 0.5) == (quant->out[i] >= 0.5);
+		}
+	}
+
+	n = dataset->pattern_num * dataset->output_num;
+	fprintf(stderr, "int8: max diff: %g, mean diff: %g, score: %f (%s: %f), agreement: %.2f%%\n",
+		max_diff, sum_diff / n, quant_score / n, PRECISION_NAME, score / n, 100.0 * agree / n);
+}
+
+
+/** 推論する
+ * 学習済みのネットワークで入力パターンの出力を計算し、一パターン一行で標準出力に書き出す。
+ * 入力はINFERENCE_BATCH_SIZE個ずつまとめて行列として計算する。重みの更新は一切行なわない。
+ *
+ * 入力はテキスト形式なら一パターンあたりネットワークの入力値の数だけの数値で、教師データは含まない。
+ * バイナリ形式の学習データならメモリマップして入力値の部分だけを使う。
+ *
+ * quantがNULLでなければ、netの代わりに量子化したネットワークで計算する。
+ *
+ * net: 学習済みのネットワーク。batch_sizeはINFERENCE_BATCH_SIZE以上である必要がある。
+ * quant: netを量子化したネットワーク。NULLなら量子化せずに計算する。batch_sizeはINFERENCE_BATCH_SIZE以上である必要がある。
+ * fname: 入力のファイル名。NULLか"-"なら標準入力から読み込む。
+ *
+ * return: 計算したパターンの数。
+ */
+int infer(const Network *net, const QuantizedNetwork *quant, const char *fname){
+	const Layer *last = &net->layers[net->layer_num-1];
+	const int input_num = net->layers[0].input_num;
+	const int output_num = last->neuron_num;
+	const real *out = quant != NULL ? quant->out : last->out;  /* 出力層の出力 */
+	int count = 0, n, i, k;
+
+	if(fname != NULL && strcmp(fname, "-") != 0 && is_binary_data(fname)){
+		Dataset dataset;
+		const int row_size = input_num + output_num;
+
+		map_data(fname, input_num, output_num, &dataset);
+		for(count=0; count<dataset.pattern_num; count+=n){
+			n = MIN(INFERENCE_BATCH_SIZE, dataset.pattern_num - count);
+			if(quant != NULL){
+				quantized_propagation(quant, dataset.data + (size_t)count*row_size, row_size, n);
+			}else{
+				forward_propagation(net, dataset.data + (size_t)count*row_size, row_size, n);
+			}
+
+			for(i=0; i<n*output_num; i++){
+				printf((i+1) % output_num == 0 ? "%lf\n" : "%lf ", out[i]);
+			}
+		}
+		free_data(&dataset);
+	}else{
+		TextReader reader;
+		FILE *fp = stdin;
+		real *input = alloc_aligned(sizeof(real) * INFERENCE_BATCH_SIZE * input_num);
+		double value;
+
+		if(fname != NULL && strcmp(fname, "-") != 0 && (fp = fopen(fname, "r")) == NULL){
+			printf("infer(): Cannot open \"%s\"\n", fname);
+			exit(1);
+		}
+		init_reader(&reader, fp);
+
+		for(;;){
+			/* 最大INFERENCE_BATCH_SIZE個のパターンを読み込む */
+			for(n=0; n<INFERENCE_BATCH_SIZE; n++){
+				if(read_number(&reader, &value) == 0){
+					break;
+				}
+				input[n*input_num] = value;
+				for(k=1; k<input_num; k++){
+					if(read_number(&reader, &value) == 0){
+						printf("infer(): Pattern %d is too short\n", count + n);
+						exit(1);
+					}
+					input[n*input_num + k] = value;
+				}
+			}
+			if(n == 0){
+				break;
+			}
+
+			if(quant != NULL){
+				quantized_propagation(quant, input, input_num, n);
+			}else{
+				forward_propagation(net, input, input_num, n);
+			}
+			for(i=0; i<n*output_num; i++){
+				printf((i+1) % output_num == 0 ? "%lf\n" : "%lf ", out[i]);
+			}
+			count += n;
+		}
+
+		if(fp != stdin){
+			fclose(fp);
+		}
+		free(reader.buffer);
+		free(input);
+	}
+
+	return count;
+}
+
+
+/** メイン関数
+ * 学習に使用するデータファイルの名前を引数で受け取り、誤差逆伝播法で学習、学習結果とそのスコアを表示する。
+ * スコアは期待する出力との差の平均であり、小さいほど実際の出力と教師データが近いことを示す。
+ *
+ * オプション-nでネットワーク定義のファイルを指定すると、その通りの層の数とニューロン数のネットワークを作る。
+ * 指定しなければINPUT_NEURON_NUM、HIDDEN_NEURON_NUM、OUTPUT_NEURON_NUMの三層のネットワークを作る。
+ *
+ * オプション-bでバッチサイズを指定すると、その数のパターンをまとめて行列として計算するミニバッチ学習を行なう。
+ * 指定しなければ1パターン毎に重みを更新する。
+ *
+ * オプション-fを指定すると、シグモイド関数を近似したexpで計算する。
+ * 精度は落ちるが(FAST_EXP_MAX_ERROR参照)、大きなネットワークでは速くなる。
+ *
+ * ネットワークの形がSMALL_KERNELSのどれかと同じなら、その形専用の計算を使う。結果は汎用の計算と同じになる。
+ * オプション-gを指定すると、比較のために常に汎用の計算を使う。
+ *
+ * オプション-tでスレッドの数を指定すると、学習データを分担して並列に学習する。0ならCPUの数だけスレッドを作る。
+ * 分担の方法はオプション-pで指定し、syncなら全スレッドの勾配をバッチ毎に合計し、hogwildなら各スレッドがロックせずに重みを更新する。
+ *
+ * オプション-mで複製の数を指定すると、乱数の種だけを変えたその数のネットワークをスレッド毎に同時に学習し、最も良いものを残す。
+ * 局所解に捕まって学習が進まなくなるのを避けるためのもので、-tとは併用出来ない。
+ *
+ * オプション-sで重みの初期化に使う乱数の種を指定する。指定しなければ現在時刻を使う。
+ * オプション-dを指定すると、実行する度に同じ結果になるよう、乱数の種を固定してsyncで学習する。多重学習では見込みの無い複製の打ち切りを止める。
+ *
+ * 学習データはテキスト形式とバイナリ形式のどちらでもよく、バイナリ形式ならメモリマップしてそのまま使う。
+ * オプション-cでファイル名を指定すると、学習はせずに学習データをバイナリ形式に変換してそのファイルに書き込む。
+ *
+ * オプション-oでファイル名を指定すると、学習した重みを学習済みモデルとして書き込む。
+ * オプション-lで学習済みモデルを指定すると、ネットワークの形と重みをそこから読み込んで学習を続ける。
+ * オプション-iで学習済みモデルを指定すると、学習はせずに入力ファイル(省略すれば標準入力)の各パターンの出力を計算する推論モードになる。
+ *
+ * オプション-Sを指定すると、学習データのファイル(省略すれば標準入力)を終わりまで読みながら、届いたパターンを順に一度だけ学習する逐次学習を行なう。
+ * 学習データを全て読み込むことはしないので、パイプで次々と届くデータを学習出来る (train_stream参照)。
+ * -oでファイル名を指定すれば、SNAPSHOT_INTERVAL個のパターン毎と最後に学習途中の重みをそこに書き出す。
+ * -q、-c、-Pは-Sと一緒には使えない。
+ *
+ * オプション-Pで割合を指定すると、学習した後に各層の重みのうち絶対値の小さいものからその割合を取り除き、残った重みだけでもう一度学習する。
+ * もう一度学習したときのログはPRUNED_LOGFILE_NAMEに記録し、その結果は枝刈りする前の学習とは別に標準エラー出力に表示する。
+ * 残った重みの密度がSPARSE_BREAK_EVEN未満の層は疎な計算を使う (prune_network参照)。推論モードでは読み込んだモデルをそのまま枝刈りして計算する。
+ *
+ * オプション-qを指定すると、重みをint8に量子化する。推論モードでは量子化したネットワークで計算する。
+ * 学習するときは、学習後に量子化したネットワークと元のネットワークの学習データでの精度の比較を標準エラー出力に表示する。
+ *
+ * オプション-Oで重みの最適化の方法を、-rで学習係数を選ぶ。学習係数を省略すると方法に合わせた既定値を使う。
+ *
+ * 学習を終えると、最適化の方法、計算精度、学習の回数、かかった時間、最後の誤差と目標の誤差に達したかを標準エラー出力に表示する。
+ * 計算精度はコンパイル時にUSE_FLOATとMASTER_DOUBLEで選ぶ (realの定義を参照)。
+ */
+int main(const int argc, const char *argv[]){
+	Network net;  /* 学習するネットワーク */
+	Dataset dataset;  /* 学習データ */
+	int default_widths[] = {INPUT_NEURON_NUM, HIDDEN_NEURON_NUM, OUTPUT_NEURON_NUM};  /* ネットワーク定義を省略したときの各層のニューロン数 */
+	int *widths = default_widths;  /* 各層のニューロン数 */
+	int width_num = sizeof(default_widths) / sizeof(int);  /* 層の数 (入力層を含む) */
+	const Layer *last;  /* 出力層 */
+	double score = 0;  /* 学習結果のスコア */
+	double error;  /* 学習を終えたときの誤差 */
+	double start_time, elapsed;  /* 学習にかかった時間の計測用 */
+	int count;  /* 学習を繰り返した回数 */
+	FILE *log_file;  /* ファイルポインタ (誤差データの保存用) */
+	const char *data_file = NULL;  /* 学習データのファイル名 */
+	const char *network_file = NULL;  /* ネットワーク定義のファイル名 */
+	const char *convert_file = NULL;  /* バイナリ形式への変換先のファイル名 */
+	const char *save_file = NULL;  /* 学習済みモデルの保存先のファイル名 */
+	const char *load_file = NULL;  /* 学習を続ける学習済みモデルのファイル名 */
+	const char *infer_file = NULL;  /* 推論に使う学習済みモデルのファイル名 */
+	int batch_size = 1;  /* ミニバッチの大きさ */
+	int sigmoid_mode = SIGMOID_EXACT;  /* シグモイド関数の計算方法 */
+	int generic = 0;  /* 0以外なら専用の計算を使わない */
+	int quantize = 0;  /* 0以外なら重みをint8に量子化する */
+	double prune_ratio = 0;  /* 枝刈りで取り除く重みの割合 */
+	int prune_count;  /* 枝刈りした後に学習を繰り返した回数 */
+	double prune_error;  /* 枝刈りした後に学習を終えたときの誤差 */
+	FILE *prune_log;  /* 枝刈りした後に学習したときのログファイル */
+	QuantizedNetwork quant;  /* 量子化したネットワーク */
+	int thread_num = 1;  /* 学習に使うスレッドの数 */
+	int strategy = STRATEGY_SYNC;  /* 並列学習の方法 */
+	int optimizer = OPTIMIZER_SGD;  /* 最適化の方法 */
+	double learning_rate = 0;  /* 学習係数。0なら最適化の方法に合わせた既定値を使う。 */
+	int replica_num = 1;  /* 多重学習で同時に学習する複製の数 */
+	int stream = 0;  /* 0以外なら入力を読みながら逐次学習する */
+	long stream_count;  /* 逐次学習で学習したパターンの数 */
+	int deterministic = 0;  /* 0以外なら実行する度に同じ結果になるようにする */
+	unsigned int seed = (unsigned int)time(NULL);  /* 重みの初期化に使う乱数の種 */
+	int seed_given = 0;  /* 乱数の種が指定されたかどうか */
+	int row_size;  /* 学習データの一行あたりの要素数 */
+	int i, p, k;
+
+	/* 引数の解析 */
+	for(i=1; i<argc; i++){
+		if(strcmp(argv[i], "-b") == 0 && i+1 < argc){
+			batch_size = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-n") == 0 && i+1 < argc){
+			network_file = argv[++i];
+		}else if(strcmp(argv[i], "-f") == 0){
+			sigmoid_mode = SIGMOID_FAST;
+		}else if(strcmp(argv[i], "-g") == 0){
+			generic = 1;
+		}else if(strcmp(argv[i], "-q") == 0){
+			quantize = 1;
+		}else if(strcmp(argv[i], "-P") == 0 && i+1 < argc){
+			prune_ratio = atof(argv[++i]);
+		}else if(strcmp(argv[i], "-t") == 0 && i+1 < argc){
+			thread_num = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-p") == 0 && i+1 < argc){
+			i++;
+			strategy = strcmp(argv[i], "hogwild") == 0 ? STRATEGY_HOGWILD : (strcmp(argv[i], "sync") == 0 ? STRATEGY_SYNC : -1);
+		}else if(strcmp(argv[i], "-O") == 0 && i+1 < argc){
+			i++;
+			for(optimizer=0; optimizer<(int)OPTIMIZER_NUM && strcmp(argv[i], OPTIMIZER_NAMES[optimizer]) != 0; optimizer++);
+		}else if(strcmp(argv[i], "-r") == 0 && i+1 < argc){
+			learning_rate = atof(argv[++i]);
+		}else if(strcmp(argv[i], "-S") == 0){
+			stream = 1;
+		}else if(strcmp(argv[i], "-m") == 0 && i+1 < argc){
+			replica_num = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-s") == 0 && i+1 < argc){
+			seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+			seed_given = 1;
+		}else if(strcmp(argv[i], "-d") == 0){
+			deterministic = 1;
+		}else if(strcmp(argv[i], "-c") == 0 && i+1 < argc){
+			convert_file = argv[++i];
+		}else if(strcmp(argv[i], "-o") == 0 && i+1 < argc){
+			save_file = argv[++i];
+		}else if(strcmp(argv[i], "-l") == 0 && i+1 < argc){
+			load_file = argv[++i];
+		}else if(strcmp(argv[i], "-i") == 0 && i+1 < argc){
+			infer_file = argv[++i];
+		}else{
+			data_file = argv[i];
+		}
+	}
+
+	/* 推論モード (学習はしない) */
+	if(infer_file != NULL){
+		static char output_buffer[1 << 16];
+
+		setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));  /* 大量の出力をまとめて書き出す */
+		load_model(infer_file, &net, INFERENCE_BATCH_SIZE);
+		net.sigmoid_mode = sigmoid_mode;
+		if(generic){
+			net.kernel = -1;
+		}
+		if(prune_ratio > 0){
+			prune_network(&net, prune_ratio);
+		}
+		if(quantize){
+			quantize_network(&quant, &net, INFERENCE_BATCH_SIZE);
+		}
+		infer(&net, quantize ? &quant : NULL, data_file);
+		if(quantize){
+			free_quantized_network(&quant);
+		}
+		free_network(&net);
+		return 0;
+	}
+
+	/* 引数の数の確認 (引数が正しくないときは実行方法を表示) */
+	if((data_file == NULL && !stream) || batch_size < 1 || thread_num < 0 || strategy < 0 || optimizer >= (int)OPTIMIZER_NUM || learning_rate < 0
+			|| replica_num < 1 || (replica_num > 1 && load_file != NULL) || prune_ratio < 0 || prune_ratio > 1
+			|| (stream && (quantize || convert_file != NULL || prune_ratio > 0))){
+		printf("実行方法 : ./a.out [-n NETWORK] [-b BATCH SIZE] [-f] [-g] [-q] [-P RATIO] [-t THREADS] [-p sync|hogwild] [-O sgd|momentum|nesterov|rmsprop|adam] [-r RATE] [-m REPLICAS] [-s SEED] [-d] [-c BINARY DATA] [-o MODEL] [-l MODEL] [LEARNING DATA]\n");
+		printf("           ./a.out -S [-n NETWORK] [-b BATCH SIZE] [-f] [-O OPTIMIZER] [-r RATE] [-s SEED] [-o MODEL] [-l MODEL] [LEARNING DATA]\n");
+		printf("           ./a.out [-q] [-P RATIO] -i MODEL [INPUT DATA]\n");
+		exit(1);
+	}
+	if(learning_rate == 0){
+		learning_rate = optimizer == OPTIMIZER_RMSPROP || optimizer == OPTIMIZER_ADAM ? ADAPTIVE_LEARNING_COEFFICIENT : LEARNING_COEFFICIENT;
+	}
+	if(thread_num == 0){
+		thread_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		thread_num = thread_num > 0 ? thread_num : 1;
+	}
+	if(stream && (thread_num != 1 || replica_num != 1)){
+		fprintf(stderr, "streaming is trained by a single thread. -t and -m are ignored.\n");
+		thread_num = 1;
+		replica_num = 1;
+	}
+	if(replica_num > 1 && thread_num != 1){
+		fprintf(stderr, "each replica is trained by a single thread. -t is ignored.\n");
+		thread_num = 1;
+	}
+	if(deterministic){
+		if(strategy == STRATEGY_HOGWILD){
+			fprintf(stderr, "hogwild is not deterministic. use sync instead.\n");
+			strategy = STRATEGY_SYNC;
+		}
+		if(!seed_given){
+			seed = DETERMINISTIC_SEED;
+		}
+	}
+
+	/* ネットワーク定義の読み込み */
+	if(load_file != NULL){
+		/* 学習済みモデルを読み込み、ネットワークの形はそれに合わせる */
+		load_model(load_file, &net, batch_size);
+		width_num = net.layer_num + 1;
+		widths = malloc(sizeof(int) * width_num);
+		widths[0] = net.layers[0].input_num;
+		for(i=0; i<net.layer_num; i++){
+			widths[i+1] = net.layers[i].neuron_num;
+		}
+	}else if(network_file != NULL){
+		width_num = read_network(network_file, &widths);
+	}
+
+	/* 逐次学習 (学習データを全て読み込むことはしない) */
+	if(stream){
+		if(load_file == NULL){
+			init_network(&net, widths, width_num, batch_size);
+			init_weight(&net, seed);
+		}else{
+			srand(seed);  /* 取っておいたパターンを選ぶのに使う */
+		}
+		net.sigmoid_mode = sigmoid_mode;
+		net.optimizer = optimizer;
+		net.learning_rate = learning_rate;
+		if(generic){
+			net.kernel = -1;
+		}
+
+		if((log_file = fopen(LOGFILE_NAME, "w")) == NULL){
+			printf("main(): Cannot open \"%s\"\n", LOGFILE_NAME);
+			exit(1);
+		}
+		start_time = wall_time();
+		stream_count = train_stream(&net, data_file, save_file, log_file, &error);
+		elapsed = wall_time() - start_time;
+		fclose(log_file);
+
+		fprintf(stderr, "optimizer: %s, precision: %s, patterns: %ld, time: %.3f sec, %.1f patterns/sec, error: %g\n",
+			OPTIMIZER_NAMES[optimizer], PRECISION_NAME, stream_count, elapsed, stream_count / (elapsed > 0 ? elapsed : 1e-9), error);
+
+		free_network(&net);
+		if(widths != default_widths){
+			free(widths);
+		}
+		return 0;
+	}
+
+	/* 学習データの読み込み */
+	if(is_binary_data(data_file)){
+		map_data(data_file, widths[0], widths[width_num-1], &dataset);
+	}else{
+		read_data(data_file, widths[0], widths[width_num-1], &dataset);
+	}
+
+	/* バイナリ形式への変換だけを行なう */
+	if(convert_file != NULL){
+		write_binary_data(convert_file, &dataset);
+		free_data(&dataset);
+		if(load_file != NULL){
+			free_network(&net);
+		}
+		if(widths != default_widths){
+			free(widths);
+		}
+		return 0;
+	}
+	row_size = dataset.input_num + dataset.output_num;
+	batch_size = MIN(batch_size, dataset.pattern_num);
+	thread_num = MIN(thread_num, dataset.pattern_num);
+
+	/* ネットワークの確保と重みの初期化 (学習済みモデルを読み込んだ場合はそのまま使う) */
+	if(load_file != NULL){
+		net.batch_size = batch_size;
+	}else{
+		init_network(&net, widths, width_num, batch_size);
+		init_weight(&net, seed);
+	}
+	net.sigmoid_mode = sigmoid_mode;
+	net.optimizer = optimizer;
+	net.learning_rate = learning_rate;
+	if(generic){
+		net.kernel = -1;
+	}
+	last = &net.layers[net.layer_num-1];
+
+	/* ログファイルをオープン */
+	if((log_file = fopen(LOGFILE_NAME, "w")) == NULL){
+		printf("main(): Cannot open \"%s\"\n", LOGFILE_NAME);
+		exit(1);
+	}
+
+	/* 学習 */
+	start_time = wall_time();
+	if(replica_num > 1){
+		count = train_restart(&net, &dataset, replica_num, seed, !deterministic, log_file, &error);
+		last = &net.layers[net.layer_num-1];
+	}else if(thread_num == 1){
+		count = train(&net, &dataset, log_file, &error);
+	}else{
+		count = train_parallel(&net, &dataset, thread_num, strategy, log_file, &error);
+	}
+	elapsed = wall_time() - start_time;
+
+	/* 枝刈りして、残った重みだけでもう一度学習する (errorは枝刈りする前の誤差のまま残す) */
+	if(prune_ratio > 0){
+		if((prune_log = fopen(PRUNED_LOGFILE_NAME, "w")) == NULL){
+			printf("main(): Cannot open \"%s\"\n", PRUNED_LOGFILE_NAME);
+			exit(1);
+		}
+		prune_network(&net, prune_ratio);
+		start_time = wall_time();
+		prune_count = train(&net, &dataset, prune_log, &prune_error);
+		fclose(prune_log);
+		fprintf(stderr, "pruned: %.1f%%, epochs: %d, time: %.3f sec, error: %g, layers:",
+			100 * prune_ratio, prune_count, wall_time() - start_time, prune_error);
+		for(i=0; i<net.layer_num; i++){
+			const Layer *layer = &net.layers[i];
+
+			fprintf(stderr, " %d/%d (%s)", layer->sparse->nnz, layer->neuron_num * layer->input_num, layer->sparse->use ? "sparse" : "dense");
+		}
+		fprintf(stderr, "\n");
+	}
+
+	fclose(log_file);  /* ログファイルを閉じる。 */
+
+	/* 学習にかかった時間を標準エラー出力に表示する (標準出力の結果は変えない) */
+	fprintf(stderr, "optimizer: %s, precision: %s, epochs: %d, time: %.3f sec, %.1f epochs/sec, error: %g (%s)\n",
+		OPTIMIZER_NAMES[optimizer], PRECISION_NAME, count, elapsed, count / (elapsed > 0 ? elapsed : 1e-9), error,
+		error <= MINIMAL_ERROR_LEVEL ? "target reached" : "target not reached");
+
+	/* 学習済みモデルの保存 */
+	if(save_file != NULL){
+		save_model(save_file, &net);
+	}
+
+	/* 量子化したときの精度を学習データで確かめる */
+	if(quantize){
+		quantize_network(&quant, &net, net.batch_size);
+		report_quantization(&net, &quant, &dataset);
+		free_quantized_network(&quant);
+	}
+
+
+	/* 計算して結果を出力する。 */
+	for(p=0; p<dataset.pattern_num; p++){
+		const real *input = dataset.data + (size_t)p*row_size;
+		const real *target = input + dataset.input_num;
+
+		forward_propagation(&net, input, row_size, 1);
+
+		printf("[%d]", p);
+		for(k=0; k<dataset.input_num; k++){
+			printf(" %lf", input[k]);
+		}
+		printf(" ===>");
+		for(k=0; k<dataset.output_num; k++){
+			printf(" %lf", last->out[k]);
+			score += fabs(target[k] - last->out[k]);
+		}
+		printf(" (");
+		for(k=0; k<dataset.output_num; k++){
+			printf(k == 0 ? "%lf" : " %lf", target[k]);
+		}
+		printf(")\n");
+	}
+	printf("\nscore: %lf\n", score / (double)(dataset.pattern_num * dataset.output_num));
+
+
+	free_network(&net);
+	free_data(&dataset);
+	if(widths != default_widths){
+		free(widths);
+	}
 
 	return 0;
 }
@@ -1,7 +1,13 @@
+#define _POSIX_C_SOURCE 200112L  /* filenoとsysconfを使うため */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #ifndef OVERRIDE_PARAMS  /* Makefile側でオプションをいじれるように */
 
@@ -11,8 +17,8 @@
 #define MUTATION_RATE 0.1  /* 突然変異の発生確率。0で起らず、1で一世代毎に全てが反転する。 */
 #define LOOP_NUM 20  /* 世代数 */
 
-#define CROSS_TYPE 1  /* 交叉のタイプ。0なら一点交叉、1なら二点交叉、2ならランダムに交叉。 */
-#define CHOICE_TYPE 0  /* 選択のタイプ。0ならルーレット方式、1ならトーナメント方式。 */
+#define CROSS_TYPE 1  /* 交叉のタイプの既定値。0なら一点交叉、1なら二点交叉、2ならランダムに交叉。オプション-xで変えられる。 */
+#define CHOICE_TYPE 0  /* 選択のタイプの既定値。0ならルーレット方式、1ならトーナメント方式。オプション-cで変えられる。 */
 
 #define SHOW_VERBOSE  /* これが定義されていれば計算過程を表示する。 */
 /* #define STOP_WHEN_DONE */  /* これが定義されていれば最適解が出た時点で計算をやめる。 */
@@ -20,37 +26,201 @@
 
 #endif
 
+#define WORD_BITS 64  /* 遺伝子を詰めて格納する一語のビット数。 */
+#define GENE_WORDS ((GENE_LENGTH + WORD_BITS - 1) / WORD_BITS)  /* 一つの遺伝子を格納するのに必要な語数。 */
+
+#define MUTATION_SKIP_RATE 0.05  /* 突然変異の確率がこれ未満なら反転するビットの間隔を引き、以上ならマスクをまとめて作る (mutation参照)。計測値。 */
+#define MUTATION_PRECISION 24  /* random_maskで作るマスクの確率の精度 (ビット数)。 */
+
+#define TRAP_SIZE 4  /* 適応度関数trapの一区間のビット数。WORD_BITSの約数にすること (delta_trap参照)。 */
+#define DELTA_TOUCHED_SIZE (GENE_WORDS * 2)  /* 差分計算で一つの子について覚えておく、変化した語の数の上限。 */
+#define FITNESS_CACHE_WAYS 8  /* 適応度のキャッシュの一つの組の項目の数。遺伝子はハッシュ値で決まる組のどれかに入る。 */
+#define FITNESS_CACHE_LOCKS 64  /* 適応度のキャッシュを守るミューテックスの数。 */
+#define FITNESS_CHUNK_SIZE 1  /* 適応度を並列に計算するときに一度に取る遺伝子の数。一つに数ミリ秒かかる適応度関数を想定している。 */
+
+#define GENE_BIT(gene, i) ((int)((gene)[(i) / WORD_BITS] >> ((i) % WORD_BITS) & 1))  /* 遺伝子geneのiビット目。0か1。 */
+
 #define LOGFILE_NAME "result.log"  /* 課題用のログファイルの名前。 */
 #define ADVANCE_LOG_NAME "advance.log"  /* 拡張ログのファイル名。 */
+#define GRID_DIRECTORY "compare"  /* 比較実行の結果を保存するディレクトリの既定値。 */
+#define PATH_LENGTH 1024  /* 比較実行で作るファイル名の最大の長さ。 */
+
+#define CHECKPOINT_MAGIC "GACP"  /* チェックポイントのファイルの先頭に書かれる識別子 */
+#define CHECKPOINT_VERSION 1  /* チェックポイントのファイルの版 */
+#define CHECKPOINT_INTERVAL 1000  /* チェックポイントを取る間隔 (世代数) の既定値。オプション-Kで変えられる。 */
+
+#define CROSS_ONE_POINT 0  /* 一点交叉 */
+#define CROSS_TWO_POINT 1  /* 二点交叉 */
+#define CROSS_UNIFORM 2  /* 一様交叉 (ランダムに交叉) */
+
+#define CHOICE_ROULETTE 0  /* ルーレット方式 */
+#define CHOICE_TOURNAMENT 1  /* トーナメント方式 */
 
+const char* CROSS_NAMES[] = {  /* 交叉のタイプの名前。添字がCROSS_*の値。比較実行のファイル名にも使う。 */
+	"one",
+	"two",
+	"rand"
+};
+#define CROSS_TYPE_NUM (sizeof(CROSS_NAMES) / sizeof(char*))
 
-/* 遺伝子の表示に使用する文字の定義。 */
+const char* CHOICE_NAMES[] = {  /* 選択のタイプの名前。添字がCHOICE_*の値。比較実行のファイル名にも使う。 */
+	"roullette",
+	"tournament"
+};
+#define CHOICE_TYPE_NUM (sizeof(CHOICE_NAMES) / sizeof(char*))
+
+#define MIGRATION_INTERVAL 20  /* 島モデルで移住する間隔 (世代数) の既定値。オプション-mで変えられる。 */
+
+#define TOPOLOGY_RING 0  /* 島を環状につなぎ、次の島へ移住する */
+#define TOPOLOGY_FULL 1  /* 全ての島をつなぎ、他の全ての島へ移住する */
+
+const char* TOPOLOGY_NAMES[] = {  /* 移住先の決め方の名前。添字がTOPOLOGY_*の値。 */
+	"ring",
+	"full"
+};
+#define TOPOLOGY_NUM (sizeof(TOPOLOGY_NAMES) / sizeof(char*))
+
+
+/* 遺伝子の表示に使用する文字の定義。引数は表示先のファイルポインタ。 */
 #if defined(COLORFUL) \
 && (defined(unix) || defined(__unix__) || defined(__unix) || defined(__APPLE__))  /* COLORFULが定義されていて、かつ*NIXならカラフルな表示をする */
-	#include <unistd.h>
-	#define TRUE_BIT (isatty(fileno(stdout)) ? "\e[47m \e[0m" : "1 ")  /* 1の代わり */
-	#define FALSE_BIT (isatty(fileno(stdout)) ? "\e[40m \e[0m" : "0 ")  /* 0の代わり */
-	#define SPLIT_BIT (isatty(fileno(stdout)) ? "\e[46m \e[0m" : "| ")  /* 遺伝子の中央に表示する文字。 */
+	#define TRUE_BIT(fp) (isatty(fileno(fp)) ? "\e[47m \e[0m" : "1 ")  /* 1の代わり */
+	#define FALSE_BIT(fp) (isatty(fileno(fp)) ? "\e[40m \e[0m" : "0 ")  /* 0の代わり */
+	#define SPLIT_BIT(fp) (isatty(fileno(fp)) ? "\e[46m \e[0m" : "| ")  /* 遺伝子の中央に表示する文字。 */
 #else  /* *NIXじゃないなら普通に文字で。 */
 	#undef COLORFUL
-	#define TRUE_BIT "1 "
-	#define FALSE_BIT "0 "
-	#define SPLIT_BIT "| "
+	#define TRUE_BIT(fp) "1 "
+	#define FALSE_BIT(fp) "0 "
+	#define SPLIT_BIT(fp) "| "
+#endif
+
+
+/* 遺伝子の一語。遺伝子のiビット目は(i/WORD_BITS)語目の下から(i%WORD_BITS)ビット目に入る。
+ * GENE_LENGTH以降の余ったビットは常に0にしておく。 */
+typedef uint64_t GeneWord;
+
+
+/** ビットの範囲のマスク
+ * 遺伝子のbeginビット目からend-1ビット目までを1にしたマスクのうち、word語目の部分を作る。
+ *
+ * word: 何語目のマスクを作るか。
+ * begin: 1にする最初のビットの番号。
+ * end: 1にする最後のビットの次の番号。
+ *
+ * return: word語目のマスク。
+ */
+GeneWord range_mask(const int word, const int begin, const int end){
+	const int lo = begin - word*WORD_BITS;  /* この語の中での範囲 */
+	const int hi = end - word*WORD_BITS;
+	const GeneWord lo_mask = lo <= 0 ? ~(GeneWord)0 : (lo >= WORD_BITS ? 0 : ~(GeneWord)0 << lo);
+	const GeneWord hi_mask = hi >= WORD_BITS ? ~(GeneWord)0 : (hi <= 0 ? 0 : ((GeneWord)1 << hi) - 1);
+
+	return lo_mask & hi_mask;
+}
+
+
+/** 1のビットを数える
+ * 語の中で1になっているビットの数を数える。GCCならCPUの命令(popcnt)を使う。
+ *
+ * x: 数えたい語。
+ *
+ * return: 1のビットの数。
+ */
+int popcount(GeneWord x){
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	x = x - (x >> 1 & 0x5555555555555555);
+	x = (x & 0x3333333333333333) + (x >> 2 & 0x3333333333333333);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0f;
+	return (int)(x * 0x0101010101010101 >> 56);
 #endif
+}
+
+
+/* 乱数生成器の状態。
+ * rand()は状態をプロセス全体で共有するので、並列に実行すると結果が再現しないうえに遅い。
+ * 実行毎にこの状態を持ち、xorshift64*で一度に64ビットずつ乱数を作る。 */
+typedef struct {
+	uint64_t state;  /* 0以外の値 */
+} Random;
+
+
+/** 乱数生成器の初期化
+ * 乱数の種から乱数生成器の状態を作る。
+ * 近い種からでも離れた状態になるように、種をsplitmix64で混ぜてから使う。
+ *
+ * random: 初期化する乱数生成器。
+ * seed: 乱数の種。
+ */
+void seed_random(Random *random, const unsigned long seed){
+	uint64_t z = (uint64_t)seed + 0x9E3779B97F4A7C15;
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+	z = z ^ (z >> 31);
+
+	random->state = z != 0 ? z : 1;  /* xorshiftの状態は0にしてはいけない */
+}
+
+
+/** ランダムな語を作る
+ * 全てのビットがランダムな語を作る。
+ *
+ * random: 使用する乱数生成器。
+ *
+ * return: ランダムな語。
+ */
+GeneWord random_word(Random *random){
+	uint64_t x = random->state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	random->state = x;
+
+	return x * 0x2545F4914F6CDD1D;
+}
+
+
+/** 0以上1未満の乱数
+ * 0以上1未満の一様な実数の乱数を作る。語の上位53ビットを使う。
+ *
+ * random: 使用する乱数生成器。
+ *
+ * return: 作った乱数。
+ */
+double random_double(Random *random){
+	return (double)(random_word(random) >> 11) / 9007199254740992.0;
+}
+
+
+/** 0以上n未満の乱数
+ * 0以上n未満の一様な整数の乱数を作る。
+ *
+ * random: 使用する乱数生成器。
+ * n: 乱数の上限。1以上。
+ *
+ * return: 作った乱数。
+ */
+int random_int(Random *random, const int n){
+	return (int)(random_double(random) * n);
+}
 
 
 /** ランダムな遺伝子を作る
  * ランダムな遺伝子で配列を初期化する。
  *
+ * random: 使用する乱数生成器。
  * genes: 初期化したい遺伝子の配列。
  */
-void make_genes(int genes[GENE_NUM][GENE_LENGTH]){
+void make_genes(Random *random, GeneWord genes[GENE_NUM][GENE_WORDS]){
 	int i, j;
 
 	/* 配列に乱数を入れていく */
 	for(i=0; i<GENE_NUM; i++){
-		for(j=0; j<GENE_LENGTH; j++){
-			genes[i][j] = rand()%2;
+		for(j=0; j<GENE_WORDS; j++){
+			genes[i][j] = random_word(random) & range_mask(j, 0, GENE_LENGTH);
 		}
 	}
 }
@@ -59,352 +229,2248 @@ void make_genes(int genes[GENE_NUM][GENE_LENGTH]){
 /** 適応度の計算
  * 与えられた遺伝子の適応度を計算する。
  * 前半のビットが全て0、後半のビットが全て1である遺伝子の適応度をGENE_LENGTHとして、1ビット違うごとに1づつ下ってゆく。
+ * 最適解との排他的論理和を取り、違っているビットを語毎にまとめて数える。
  *
- * gene: 計算したい個体の遺伝子。0か1の値しか取らない。
+ * gene: 計算したい個体の遺伝子。
  *
  * return: 計算した適応度。
  */
-int calc_fitness(const int gene[GENE_LENGTH]){
-	int fitness = 0;
+int calc_fitness(const GeneWord gene[GENE_WORDS]){
+	int fitness = GENE_LENGTH;
 	int i;
 
-	for(i=0; i<GENE_LENGTH; i++){
-		if(i < GENE_LENGTH/2){
-			fitness += gene[i] == 0;
-		}else{
-			fitness += gene[i] == 1;
-		}
+	for(i=0; i<GENE_WORDS; i++){
+		fitness -= popcount(gene[i] ^ range_mask(i, GENE_LENGTH/2, GENE_LENGTH));
 	}
 
 	return fitness;
 }
 
 
-/** 適応度をまとめて計算する
- * 遺伝子の配列について、全ての適応度をまとめて計算し、引数で与えられた配列に結果を代入する。
+/* 遺伝子の一語分の変化。
+ * 親の遺伝子のword語目をmaskとの排他的論理和で反転すると子の遺伝子になる。 */
+typedef struct {
+	int word;  /* 変化した語の番号 */
+	GeneWord mask;  /* 反転したビット */
+} GeneChange;
+
+
+/** 適応度関数: target
+ * calc_fitnessで複数の遺伝子の適応度をまとめて計算する。前半が0、後半が1の遺伝子が最適解。
  *
  * genes: 計算したい遺伝子の配列。
- * fitnesses: 計算結果を保存する配列。0以上GENE_LENGTH未満の値が入る。
+ * fitnesses: 計算した適応度の保存先。
+ * num: 遺伝子の数。
  */
-void calc_fitness_list(
-		const int genes[GENE_NUM][GENE_LENGTH],
-		int fitnesses[GENE_NUM]
-){
+void evaluate_target(const GeneWord genes[][GENE_WORDS], int fitnesses[], const int num){
 	int i;
 
-	for(i=0; i<GENE_NUM; i++){
+	for(i=0; i<num; i++){
 		fitnesses[i] = calc_fitness(genes[i]);
 	}
 }
 
 
-/** 適応度の合計を計算する
- * 配列で渡されたすべての遺伝子の適応度の合計を計算する。
+/** 適応度関数: targetの差分計算
+ * 親の適応度と変化したビットから、子の適応度を計算する。
+ * 反転したビットのうち最適解と一致しなくなったものは1ずつ、一致するようになったものは1ずつ適応度を増減させる。
  *
- * genes: 計算したい遺伝子の配列。
+ * gene: 子の遺伝子。
+ * changes: 親から変化した語の一覧。
+ * change_num: 変化した語の数。
+ * fitness: 親の適応度。
  *
- * return: 引数genesの全ての遺伝子の適応度の合計。
+ * return: 子の適応度。
  */
-int sum_fitness(const int genes[GENE_NUM][GENE_LENGTH]){
-	int sum = 0;
+int delta_target(const GeneWord gene[GENE_WORDS], const GeneChange changes[], const int change_num, int fitness){
+	GeneWord wrong;  /* 反転した結果、最適解と違うビット */
 	int i;
 
-	for(i=0; i<GENE_NUM; i++){
-		sum += calc_fitness(genes[i]);
+	for(i=0; i<change_num; i++){
+		wrong = (gene[changes[i].word] ^ range_mask(changes[i].word, GENE_LENGTH/2, GENE_LENGTH)) & changes[i].mask;
+		fitness += popcount(changes[i].mask) - 2*popcount(wrong);
 	}
 
-	return sum;
+	return fitness;
 }
 
 
-/** 交叉に使う個体をランダムに一つ選ぶ
- * 交叉に使用する個体をランダムに一つ選ぶ。
- * 選択の方法はCHOICE_TYPE定数によって決まる。
+/** 適応度関数: onemax
+ * 1になっているビットの数を適応度とする。全てのビットが1の遺伝子が最適解。
  *
- * genes: 遺伝子の一覧。この中からランダムに一つ選ぶ。
- *
- * return: 選ばれた遺伝子へのポインタ。
+ * genes: 計算したい遺伝子の配列。
+ * fitnesses: 計算した適応度の保存先。
+ * num: 遺伝子の数。
  */
-int* choice(const int genes[GENE_NUM][GENE_LENGTH]){
-#if CHOICE_TYPE == 0
-	const int select = rand() % sum_fitness(genes);
-	int fit = 0;
-	int i;
+void evaluate_onemax(const GeneWord genes[][GENE_WORDS], int fitnesses[], const int num){
+	int i, j;
 
-	for(i=0; i<GENE_NUM; i++){
-		fit += calc_fitness(genes[i]);
-		if(fit >= select){
-			break;
+	for(i=0; i<num; i++){
+		fitnesses[i] = 0;
+		for(j=0; j<GENE_WORDS; j++){
+			fitnesses[i] += popcount(genes[i][j]);
 		}
 	}
+}
 
-	return (int*)genes[i];
-#else
-	const int a = rand()%GENE_NUM;  /* 一つめの候補は適当に決める。 */
-	int b;
 
-	/* 二つめの候補は一つめと被らないように決める。 */
-	do{
-		b = rand()%GENE_NUM;
-	}while(a == b);
+/** 適応度関数: onemaxの差分計算
+ * 反転して1になったビットの数だけ増やし、0になったビットの数だけ減らす。
+ *
+ * gene: 子の遺伝子。
+ * changes: 親から変化した語の一覧。
+ * change_num: 変化した語の数。
+ * fitness: 親の適応度。
+ *
+ * return: 子の適応度。
+ */
+int delta_onemax(const GeneWord gene[GENE_WORDS], const GeneChange changes[], const int change_num, int fitness){
+	int i;
 
-	/* 適応度の高い方を選ぶ。 */
-	if(calc_fitness(genes[a]) > calc_fitness(genes[b])){
-		return (int*)genes[a];
-	}else{
-		return (int*)genes[b];
+	for(i=0; i<change_num; i++){
+		fitness += 2*popcount(gene[changes[i].word] & changes[i].mask) - popcount(changes[i].mask);
 	}
-#endif
+
+	return fitness;
 }
 
 
-/** 適応度が最も高い個体を探す
- * 与えられた遺伝子の配列のうち、適応度が最も高い個体を探す。
+/** trapの一区間の適応度
+ * 区間の1の数から、その区間の適応度を計算する。
  *
- * genes: 探したい遺伝子の一覧。
+ * ones: 区間の中の1の数。
  *
- * return: 渡された遺伝子の中で最も適応度が高い遺伝子へのポインタ。
+ * return: 区間の適応度。
  */
-int* find_max_fitness(const int genes[GENE_NUM][GENE_LENGTH]){
-	int i, max_fit=0, max_idx;
+int trap_score(const int ones){
+	return ones == TRAP_SIZE ? TRAP_SIZE : TRAP_SIZE - 1 - ones;
+}
 
-	for(i=0; i<GENE_NUM; i++){
-		int fit = calc_fitness(genes[i]);
-		if(fit > max_fit){
-			max_fit = fit;
-			max_idx = i;
+
+/** 適応度関数: trap
+ * 遺伝子をTRAP_SIZEビットずつの区間に分け、区間毎の適応度を合計する。
+ * 区間の1の数をuとすると、区間の適応度は全て1ならTRAP_SIZE、そうでなければTRAP_SIZE-1-u。
+ * 1を増やすほど局所的には損をする騙し問題で、全てのビットが1の遺伝子が最適解。
+ * 区間に収まらない末尾のビットは1の数をそのまま数える。
+ *
+ * genes: 計算したい遺伝子の配列。
+ * fitnesses: 計算した適応度の保存先。
+ * num: 遺伝子の数。
+ */
+void evaluate_trap(const GeneWord genes[][GENE_WORDS], int fitnesses[], const int num){
+	int i, j, k, ones;
+
+	for(i=0; i<num; i++){
+		fitnesses[i] = 0;
+		for(j=0; j+TRAP_SIZE<=GENE_LENGTH; j+=TRAP_SIZE){
+			ones = 0;
+			for(k=j; k<j+TRAP_SIZE; k++){
+				ones += GENE_BIT(genes[i], k);
+			}
+			fitnesses[i] += trap_score(ones);
+		}
+		for(; j<GENE_LENGTH; j++){
+			fitnesses[i] += GENE_BIT(genes[i], j);
 		}
 	}
-
-	return (int*)genes[max_idx];
 }
 
 
-/** 適応度が最も低い個体を探す
- * 与えられた遺伝子の配列のうち、適応度が最も低い個体を探す。
+/** 適応度関数: trapの差分計算
+ * 反転したビットを含む区間だけ、親と子の区間の適応度の差を足す。
+ * TRAP_SIZEはWORD_BITSの約数なので、区間が語をまたぐことはない。
+ * 区間に収まらない末尾のビットはonemaxと同じように数える。
  *
- * genes: 探したい遺伝子の一覧。
+ * gene: 子の遺伝子。
+ * changes: 親から変化した語の一覧。
+ * change_num: 変化した語の数。
+ * fitness: 親の適応度。
  *
- * return: 渡された遺伝子の中で最も適応度が低い遺伝子へのポインタ。
+ * return: 子の適応度。
  */
-int* find_min_fitness(const int genes[GENE_NUM][GENE_LENGTH]){
-	int i, min_fit=GENE_LENGTH, min_idx;
-
-	for(i=0; i<GENE_NUM; i++){
-		int fit = calc_fitness(genes[i]);
-		if(fit < min_fit){
-			min_fit = fit;
-			min_idx = i;
+int delta_trap(const GeneWord gene[GENE_WORDS], const GeneChange changes[], const int change_num, int fitness){
+	const int trap_end = GENE_LENGTH - GENE_LENGTH % TRAP_SIZE;  /* 区間に収まるビットの終わり */
+	const GeneWord block = ((GeneWord)1 << TRAP_SIZE) - 1;  /* 一区間分のマスク */
+	GeneWord child, parent, mask;
+	int i, offset;
+
+	for(i=0; i<change_num; i++){
+		child = gene[changes[i].word];
+		parent = child ^ changes[i].mask;
+		for(offset=0; offset<WORD_BITS; offset+=TRAP_SIZE){
+			mask = changes[i].mask >> offset & block;
+			if(mask == 0){
+				continue;
+			}
+			if(changes[i].word*WORD_BITS + offset < trap_end){
+				fitness += trap_score(popcount(child >> offset & block)) - trap_score(popcount(parent >> offset & block));
+			}else{
+				fitness += 2*popcount(child >> offset & mask) - popcount(mask);
+			}
 		}
 	}
 
-	return (int*)genes[min_idx];
+	return fitness;
 }
 
 
-/** 二つの遺伝子を交叉させて新たな遺伝子を作る
- * 引数で与えられた二つの遺伝子を交叉させて新たな遺伝子を作り、引数childに格納する。
- * 交叉の方法は定数CROSS_TYPEによって決定される。
+/* 適応度関数。
+ * 複数の遺伝子をまとめて受け取り、それぞれの適応度を計算する。適応度は0以上GENE_LENGTH以下の整数で、GENE_LENGTHが最適解。
+ * 並列に計算するときは一つの世代を分けて別々のスレッドから呼ばれるので、関数は状態を持たないこと。
+ * 親の適応度と変化したビットから子の適応度を計算できるなら、deltaも用意する。
+ * deltaがあれば交叉と突然変異で変化したビットを追い、変化の量に比例する手間で子を評価する (evaluate_delta参照)。
+ * 新しい適応度関数はFITNESS_FUNCTIONSに追加すれば、オプション-fで選べるようになる。 */
+typedef struct {
+	const char *name;  /* オプション-fで指定する名前 */
+	void (*evaluate)(const GeneWord genes[][GENE_WORDS], int fitnesses[], int num);  /* 適応度を計算する関数 */
+	int (*delta)(const GeneWord gene[GENE_WORDS], const GeneChange changes[], int change_num, int fitness);  /* 差分から適応度を計算する関数。無ければNULL。 */
+} FitnessFunction;
+
+const FitnessFunction FITNESS_FUNCTIONS[] = {  /* 使える適応度関数。先頭が既定値。 */
+	{"target", evaluate_target, delta_target},
+	{"onemax", evaluate_onemax, delta_onemax},
+	{"trap", evaluate_trap, delta_trap}
+};
+#define FITNESS_FUNCTION_NUM (sizeof(FITNESS_FUNCTIONS) / sizeof(FitnessFunction))
+
+
+/* 適応度を並列に計算するスレッドプール。
+ * 世代毎にスレッドを作り直さないように、スレッドは最初に作って仕事を待たせておく。
+ * 仕事を頼んだスレッドも一緒に計算する。
+ * 各スレッドはnext_indexからFITNESS_CHUNK_SIZE個ずつ遺伝子を取っていくので、計算時間が個体毎に違っても負荷が偏らない。 */
+typedef struct {
+	pthread_mutex_t mutex;  /* 以下の変数を守る */
+	pthread_cond_t start;  /* 新しい仕事が来たことを知らせる */
+	pthread_cond_t finish;  /* 全てのスレッドが仕事を終えたことを知らせる */
+	pthread_t *threads;  /* 待っているスレッド */
+	int thread_num;  /* 仕事を頼んだスレッドを含むスレッドの数 */
+	int round;  /* 何回目の仕事か。スレッドはこれが変わったら新しい仕事を始める。 */
+	int active;  /* 仕事をしているスレッドの数 */
+	int quit;  /* 1ならスレッドを終了する */
+	const FitnessFunction *function;  /* 今の仕事の適応度関数 */
+	const GeneWord (*genes)[GENE_WORDS];  /* 今の仕事の遺伝子 */
+	int *fitnesses;  /* 今の仕事の適応度の保存先 */
+	int gene_num;  /* 今の仕事の遺伝子の数 */
+	int next_index;  /* 次に取る遺伝子の番号。__atomic組み込み関数で増やす。 */
+} FitnessPool;
+
+
+/** スレッドプールの仕事をする
+ * 今の仕事の遺伝子をFITNESS_CHUNK_SIZE個ずつ取り、無くなるまで適応度を計算する。
  *
- * a: 一つめの親。
- * b: 二つめの親。
- * child: 生成した子供を保存する先。
+ * pool: スレッドプール。
  */
-void cross(
-		const int a[GENE_LENGTH],
-		const int b[GENE_LENGTH],
-		int child[GENE_LENGTH]
-){
-	int i;
-#if CROSS_TYPE == 0
-	const int pivot = rand()%(GENE_LENGTH-2) + 1;
+void work_fitness_pool(FitnessPool *pool){
+	int begin, num;
 
-	for(i=0; i<GENE_LENGTH; i++){
-		child[i] = i < pivot ? a[i] : b[i];
+	for(;;){
+		begin = __atomic_fetch_add(&pool->next_index, FITNESS_CHUNK_SIZE, __ATOMIC_RELAXED);
+		if(begin >= pool->gene_num){
+			break;
+		}
+		num = pool->gene_num - begin < FITNESS_CHUNK_SIZE ? pool->gene_num - begin : FITNESS_CHUNK_SIZE;
+		pool->function->evaluate(pool->genes + begin, pool->fitnesses + begin, num);
 	}
-#elif CROSS_TYPE == 1
-	const int pivot_b = rand()%(GENE_LENGTH-3) + 2;
-	const int pivot_a = rand()%pivot_b + 1;
+}
 
-	for(i=0; i<GENE_LENGTH; i++){
-		child[i] = i < pivot_a || pivot_b < i ? a[i] : b[i];
-	}
-#else
-	for(i=0; i<GENE_LENGTH; i++){
-		child[i] = rand()%2 ? a[i] : b[i];
+
+/** スレッドプールのスレッド
+ * 仕事が来るのを待ち、来たら計算して、全員が終わったら仕事を頼んだスレッドに知らせる。
+ *
+ * arg: スレッドプール (FitnessPool)。
+ *
+ * return: 常にNULL。
+ */
+void* fitness_pool_thread(void *arg){
+	FitnessPool *pool = (FitnessPool*)arg;
+	int round = 0;  /* 最後にした仕事 */
+
+	for(;;){
+		pthread_mutex_lock(&pool->mutex);
+		while(pool->round == round && !pool->quit){
+			pthread_cond_wait(&pool->start, &pool->mutex);
+		}
+		if(pool->quit){
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+		round = pool->round;
+		pthread_mutex_unlock(&pool->mutex);
+
+		work_fitness_pool(pool);
+
+		pthread_mutex_lock(&pool->mutex);
+		if(--pool->active == 0){
+			pthread_cond_signal(&pool->finish);
+		}
+		pthread_mutex_unlock(&pool->mutex);
 	}
-#endif
+
+	return NULL;
 }
 
 
-/** 突然変異を発生させる
- * 与えられた遺伝子の配列全体について、定数MUTATION_RATEの確率で突然変異を起こす。
+/** スレッドプールの初期化
+ * thread_num-1個のスレッドを作り、仕事を待たせる。
  *
- * genes: 突然変異を起こしたい遺伝子の配列。
+ * pool: 初期化するスレッドプール。
+ * thread_num: 仕事を頼むスレッドを含むスレッドの数。
  */
-void mutation(int genes[GENE_NUM][GENE_LENGTH]){
-	int i, j;
+void init_fitness_pool(FitnessPool *pool, const int thread_num){
+	int i;
 
-	for(i=0; i<GENE_NUM; i++){
-		for(j=0; j<GENE_LENGTH; j++){
-			if(MUTATION_RATE > (double)rand()/RAND_MAX){
-				genes[i][j] = !genes[i][j];
-			}
-		}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->finish, NULL);
+	pool->thread_num = thread_num;
+	pool->round = 0;
+	pool->active = 0;
+	pool->quit = 0;
+	pool->threads = malloc(sizeof(pthread_t) * thread_num);
+	for(i=1; i<thread_num; i++){
+		pthread_create(&pool->threads[i], NULL, fitness_pool_thread, pool);
 	}
 }
 
 
-/** 遺伝子情報を表示する
- * 一つの遺伝子の情報を表示する。
- * 表示に使用する文字は定数TRUE_BITとFALSE_BITによって定義される。
- * また、遺伝子の中央にはSPLIT_BITが表示される。
- * いずれの定数も文字列で、任意の長さを設定出来る。
+/** スレッドプールの解放
+ * 待っているスレッドを終了させ、スレッドプールを解放する。
  *
- * gene: 表示したい遺伝子。
+ * pool: 解放するスレッドプール。
  */
-void show_gene(const int gene[GENE_LENGTH]){
+void free_fitness_pool(FitnessPool *pool){
 	int i;
 
-	for(i=0; i<GENE_LENGTH; i++){
-		if(i == GENE_LENGTH/2){
-			printf(SPLIT_BIT);
-		}
-		printf("%s", gene[i] ? TRUE_BIT : FALSE_BIT);
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->mutex);
+	for(i=1; i<pool->thread_num; i++){
+		pthread_join(pool->threads[i], NULL);
 	}
-	printf(" (%d%%)\n", calc_fitness(gene)*100/GENE_LENGTH);
+
+	free(pool->threads);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->finish);
+	pthread_mutex_destroy(&pool->mutex);
 }
 
 
-/** 一世代の情報を表示する
- * 一世代全ての遺伝子の情報を表示する。
- * show_gene関数で表示される情報に加え、その世代における最大、最小、平均などの値も表示される。
+/** 適応度を並列に計算する
+ * num個の遺伝子の適応度を、スレッドプールの全てのスレッドで手分けして計算する。
+ * 全ての適応度を計算し終えてから返る。
  *
- * generation_id: 何世代目かを表わす番号。表示に使われるだけ。ゼロオリジンを想定している（=表示の時に+1される）ので注意。
- * genes: 表示したい遺伝子の配列。
+ * pool: スレッドプール。
+ * function: 使用する適応度関数。
+ * genes: 計算したい遺伝子の配列。
+ * fitnesses: 計算した適応度の保存先。
+ * num: 遺伝子の数。GENE_NUM以下。
+ */
+void evaluate_parallel(
+		FitnessPool *pool,
+		const FitnessFunction *function,
+		const GeneWord genes[][GENE_WORDS],
+		int fitnesses[],
+		const int num
+){
+	pthread_mutex_lock(&pool->mutex);
+	pool->function = function;
+	pool->genes = genes;
+	pool->fitnesses = fitnesses;
+	pool->gene_num = num;
+	pool->next_index = 0;
+	pool->active = pool->thread_num - 1;
+	pool->round++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->mutex);
+
+	work_fitness_pool(pool);
+
+	pthread_mutex_lock(&pool->mutex);
+	while(pool->active > 0){
+		pthread_cond_wait(&pool->finish, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/* 適応度のキャッシュの一つの項目。 */
+typedef struct {
+	uint64_t hash;  /* 遺伝子のハッシュ値 (hash_gene参照) */
+	int fitness;  /* 遺伝子の適応度 */
+	int used;  /* 0なら空き */
+	int referenced;  /* 最後に追い出す遺伝子を探してから使われたら1 (クロック方式) */
+	GeneWord gene[GENE_WORDS];  /* 遺伝子。ハッシュ値が衝突しても取り違えないように全体を持つ。 */
+} CacheEntry;
+
+
+/* 遺伝子から適応度を引くキャッシュ。
+ * 収束した世代ではエリートの複製や同じ遺伝子が何度も現れるので、計算に時間のかかる適応度関数では一度計算した値を使い回す。
+ * 項目はFITNESS_CACHE_WAYS個ずつの組に分かれ、遺伝子はハッシュ値で決まる組のどれかに入る。
+ * 組が一杯になったら、組毎の時計の針を回して最近使われていない項目を追い出す (クロック方式)。
+ * 複数の実行で共有できるように、組はFITNESS_CACHE_LOCKS個のミューテックスで分けて守る。
+ * 統計はロックを持たずに__atomic組み込み関数で数える。 */
+typedef struct {
+	CacheEntry *entries;  /* set_num * FITNESS_CACHE_WAYS個の項目 */
+	int *hands;  /* 組毎の時計の針 */
+	int set_num;  /* 組の数。2の冪。 */
+	pthread_mutex_t locks[FITNESS_CACHE_LOCKS];  /* 組の番号をFITNESS_CACHE_LOCKSで割った余りが同じ組を守る */
+	unsigned long lookups;  /* 引いた回数 */
+	unsigned long hits;  /* 見つかった回数 */
+	unsigned long evictions;  /* 追い出した回数 */
+} FitnessCache;
+
+
+/** 遺伝子のハッシュ値
+ * 遺伝子の全ての語を混ぜ合わせたハッシュ値を作る。混ぜ方はseed_randomと同じsplitmix64。
+ *
+ * gene: ハッシュ値を作りたい遺伝子。
+ *
+ * return: ハッシュ値。
  */
-void show_generation(const int generation_id, const int genes[GENE_NUM][GENE_LENGTH]){
+uint64_t hash_gene(const GeneWord gene[GENE_WORDS]){
+	uint64_t z = 0x9E3779B97F4A7C15;
 	int i;
 
-	for(i=0; i<GENE_NUM; i++){
-		show_gene(genes[i]);
+	for(i=0; i<GENE_WORDS; i++){
+		z = (z ^ gene[i]) * 0xBF58476D1CE4E5B9;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+		z = z ^ (z >> 31);
 	}
 
-	printf("generation: %d\n", generation_id + 1);
-	printf("max: %d%%\n", calc_fitness(find_max_fitness(genes))*100/GENE_LENGTH);
-	printf("min: %d%%\n", calc_fitness(find_min_fitness(genes))*100/GENE_LENGTH);
-	printf("average: %d%%\n", sum_fitness(genes)*100/GENE_NUM/GENE_LENGTH);
+	return z;
 }
 
 
-/** ソート用の比較関数
- * int配列のソートに使用するための比較関数。
+/** キャッシュの初期化
+ * 少なくともentry_num個の遺伝子を覚えられる空のキャッシュを作る。
+ *
+ * cache: 初期化するキャッシュ。
+ * entry_num: 覚えたい遺伝子の数。組の数が2の冪になるように切り上げる。
  */
-int sort_cmp(const int* a, const int* b){
-	return *b - *a;
+void init_fitness_cache(FitnessCache *cache, const long entry_num){
+	int i;
+
+	for(cache->set_num=1; (long)cache->set_num*FITNESS_CACHE_WAYS < entry_num; cache->set_num*=2);
+	cache->entries = calloc((size_t)cache->set_num * FITNESS_CACHE_WAYS, sizeof(CacheEntry));
+	cache->hands = calloc(cache->set_num, sizeof(int));
+	for(i=0; i<FITNESS_CACHE_LOCKS; i++){
+		pthread_mutex_init(&cache->locks[i], NULL);
+	}
+	cache->lookups = 0;
+	cache->hits = 0;
+	cache->evictions = 0;
 }
 
 
-/** ログファイルに一世代分の情報を追記する
- * 二種類のログファイルに一世代分の情報を追記する。
+/** キャッシュの解放
  *
- * normalログには講義で指示された基本的な内容が記録される。
- * advanceログにはその世代における最大、最小、平均、中央値が記録される。
+ * cache: 解放するキャッシュ。
+ */
+void free_fitness_cache(FitnessCache *cache){
+	int i;
+
+	for(i=0; i<FITNESS_CACHE_LOCKS; i++){
+		pthread_mutex_destroy(&cache->locks[i]);
+	}
+	free(cache->hands);
+	free(cache->entries);
+}
+
+
+/** キャッシュを引く
+ * 遺伝子の適応度がキャッシュにあれば取り出す。
  *
- * 内部で呼び出された回数を数えており、normalログへの記録に使用している。
+ * cache: 引くキャッシュ。
+ * hash: 遺伝子のハッシュ値。
+ * gene: 探す遺伝子。
+ * fitness: 見つかった適応度の保存先。
  *
- * normal: 課題用のログファイルへのファイルポインタ。
- * advance: 拡張ログファイルへのファイルポインタ。
- * genes: 記録したい世代の遺伝子の配列。
+ * return: 見つかれば1、無ければ0。
  */
-void write_log(
-		FILE* normal,
-		FILE* advance,
-		const int genes[GENE_NUM][GENE_LENGTH]
-){
-	int fitnesses[GENE_NUM];
-	double avg;
+int lookup_fitness_cache(FitnessCache *cache, const uint64_t hash, const GeneWord gene[GENE_WORDS], int *fitness){
+	const int set = (int)(hash & (uint64_t)(cache->set_num - 1));
+	CacheEntry *entries = cache->entries + (size_t)set * FITNESS_CACHE_WAYS;
+	int found = 0;
+	int i;
+
+	pthread_mutex_lock(&cache->locks[set % FITNESS_CACHE_LOCKS]);
+	for(i=0; i<FITNESS_CACHE_WAYS; i++){
+		if(entries[i].used && entries[i].hash == hash && memcmp(entries[i].gene, gene, sizeof(entries[i].gene)) == 0){
+			entries[i].referenced = 1;
+			*fitness = entries[i].fitness;
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->locks[set % FITNESS_CACHE_LOCKS]);
 
-	static int count = 0;
-	count++;
+	__atomic_fetch_add(&cache->lookups, 1, __ATOMIC_RELAXED);
+	if(found){
+		__atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+	}
 
+	return found;
+}
 
-	calc_fitness_list((const int (*)[GENE_LENGTH])genes, fitnesses);
-	qsort(
-		fitnesses,
-		GENE_NUM,
-		sizeof(int),
-		(int (*)(const void*, const void*))sort_cmp
-	);
 
-	avg = (double)sum_fitness((const int (*)[GENE_LENGTH])genes)/GENE_NUM;
+/** キャッシュに入れる
+ * 遺伝子の適応度をキャッシュに覚える。
+ * 組に空きが無ければ、時計の針を進めながら使われた印を消していき、印の無い最初の項目を追い出す。
+ * 他の実行が先に同じ遺伝子を入れていたら何もしない。
+ *
+ * cache: 入れるキャッシュ。
+ * hash: 遺伝子のハッシュ値。
+ * gene: 覚える遺伝子。
+ * fitness: 遺伝子の適応度。
+ */
+void insert_fitness_cache(FitnessCache *cache, const uint64_t hash, const GeneWord gene[GENE_WORDS], const int fitness){
+	const int set = (int)(hash & (uint64_t)(cache->set_num - 1));
+	CacheEntry *entries = cache->entries + (size_t)set * FITNESS_CACHE_WAYS;
+	int victim = -1;
+	int i;
+
+	pthread_mutex_lock(&cache->locks[set % FITNESS_CACHE_LOCKS]);
+	for(i=0; i<FITNESS_CACHE_WAYS; i++){
+		if(!entries[i].used){
+			if(victim < 0){
+				victim = i;
+			}
+		}else if(entries[i].hash == hash && memcmp(entries[i].gene, gene, sizeof(entries[i].gene)) == 0){
+			pthread_mutex_unlock(&cache->locks[set % FITNESS_CACHE_LOCKS]);
+			return;
+		}
+	}
+	if(victim < 0){
+		while(entries[cache->hands[set]].referenced){
+			entries[cache->hands[set]].referenced = 0;
+			cache->hands[set] = (cache->hands[set] + 1) % FITNESS_CACHE_WAYS;
+		}
+		victim = cache->hands[set];
+		cache->hands[set] = (cache->hands[set] + 1) % FITNESS_CACHE_WAYS;
+		__atomic_fetch_add(&cache->evictions, 1, __ATOMIC_RELAXED);
+	}
+
+	entries[victim].hash = hash;
+	entries[victim].fitness = fitness;
+	entries[victim].used = 1;
+	entries[victim].referenced = 0;
+	memcpy(entries[victim].gene, gene, sizeof(entries[victim].gene));
+	pthread_mutex_unlock(&cache->locks[set % FITNESS_CACHE_LOCKS]);
+}
+
 
-	fprintf(normal, "%d %lf %d\n", count, avg, fitnesses[0]);
+/** キャッシュの統計を表示する
+ * 引いた回数、見つかった割合、追い出した回数を表示する。
+ *
+ * output: 表示先。
+ * cache: 表示するキャッシュ。
+ */
+void show_fitness_cache(FILE *output, const FitnessCache *cache){
 	fprintf(
-		advance,
-		"%lf %lf %lf %lf\n",
-		avg/GENE_LENGTH,
-		(double)fitnesses[0]/GENE_LENGTH,
-		(double)fitnesses[GENE_NUM-1]/GENE_LENGTH,
-		(double)fitnesses[GENE_NUM/2]/GENE_LENGTH
+		output,
+		"fitness cache: %d entries, %lu lookups, %lu hits (%.1f%%), %lu evictions\n",
+		cache->set_num * FITNESS_CACHE_WAYS,
+		cache->lookups,
+		cache->hits,
+		cache->lookups > 0 ? cache->hits * 100.0 / cache->lookups : 0.0,
+		cache->evictions
 	);
 }
 
 
-/** メイン関数
- * メイン関数。引数は受けとらない。
- * 
- * 遺伝子の生成や計算、表示などの関数の呼び出しを行なう。
- * 計算はLOOP_NUM世代繰り返して行なわれる。
+/** 一世代
+ * 一世代分の遺伝子と、その適応度。
+ * 適応度はevaluate_generationで世代毎に一度だけ計算し、選択や表示、ログではその値を使う。
  */
-int main(const int argc, const char* argv[]){
-	int genes[GENE_NUM][GENE_LENGTH];
-	int next[GENE_NUM][GENE_LENGTH];
-	int i, j;
-	FILE* log_file = fopen(LOGFILE_NAME, "w");
-	FILE* adv_log_file = fopen(ADVANCE_LOG_NAME, "w");
+typedef struct {
+	GeneWord genes[GENE_NUM][GENE_WORDS];  /* 遺伝子 */
+	int fitnesses[GENE_NUM];  /* 各遺伝子の適応度 */
+	int cumulative[GENE_NUM];  /* 適応度の累積和。cumulative[i]は0番目からi番目までの遺伝子の適応度の合計。 */
+} Generation;
+
+
+/* 子の遺伝子が親からどう変化したか。
+ * changedは親との排他的論理和で、touchedに入っている語以外は常に0にしておく。
+ * 使い終わったらtouchedの語だけを0に戻すので、遺伝子の長さに比例する初期化は要らない。 */
+typedef struct {
+	int base_fitness;  /* 元にした親の適応度 */
+	int touched_num;  /* touchedに入っている語の数。DELTA_TOUCHED_SIZEを超えたら差分を追うのをやめる。 */
+	int touched[DELTA_TOUCHED_SIZE];  /* 変化したかもしれない語の番号。同じ語が何度か入っていることもある。 */
+	GeneWord changed[GENE_WORDS];  /* 親から反転したビット */
+} GeneDelta;
+
+
+/** チェックポイントのファイルのヘッダ
+ * チェックポイントのファイルの先頭に置かれる情報。ヘッダの後には今の世代の遺伝子がGENE_NUM * GENE_WORDS語続く。
+ * 適応度は遺伝子から計算し直せるので記録しない。
+ * 数値は全て書き込んだ計算機のバイトオーダーで記録される。
+ */
+typedef struct {
+	char magic[4];  /* CHECKPOINT_MAGIC */
+	int version;  /* CHECKPOINT_VERSION */
+	int gene_length;  /* GENE_LENGTH。読み込むときに一致しなければならない。 */
+	int gene_num;  /* GENE_NUM。読み込むときに一致しなければならない。 */
+	int cross_type;  /* 交叉のタイプ */
+	int choice_type;  /* 選択のタイプ */
+	int fitness;  /* 適応度関数のFITNESS_FUNCTIONSでの番号 */
+	int log_interval;  /* ログに記録する間隔 */
+	int generation;  /* 終えた世代の計算の回数。再開するとここから数える。 */
+	unsigned long seed;  /* 最初に使った乱数の種 */
+	uint64_t random_state;  /* 乱数生成器の状態 */
+	long normal_log_position;  /* 課題用のログファイルの書き込み位置。記録していなければ-1。 */
+	long advance_log_position;  /* 拡張ログファイルの書き込み位置。記録していなければ-1。 */
+} CheckpointHeader;
+
+
+/* チェックポイント。一回の実行を再開するのに必要な全ての状態。 */
+typedef struct {
+	CheckpointHeader header;
+	GeneWord genes[GENE_NUM][GENE_WORDS];  /* 今の世代の遺伝子 */
+} Checkpoint;
+
+
+/* チェックポイントを非同期に書き込むスレッド。
+ * 計算するスレッドはpendingに状態を写すだけで、ファイルへの書き込みはこのスレッドが行なう。
+ * 書き込みが追い付かなければ、まだ書いていないチェックポイントは新しいもので上書きする。 */
+typedef struct {
+	pthread_mutex_t mutex;  /* pendingとhas_pendingとquitを守る */
+	pthread_cond_t ready;  /* 書き込むチェックポイントが来たことを知らせる */
+	pthread_t thread;  /* 書き込むスレッド */
+	const char *fname;  /* 書き込み先のファイル名 */
+	Checkpoint pending;  /* 書き込みを待っているチェックポイント */
+	Checkpoint writing;  /* 書き込んでいるチェックポイント */
+	int has_pending;  /* 1ならpendingを書き込む必要がある */
+	int quit;  /* 1ならpendingを書き込んだ後にスレッドを終了する */
+} Checkpointer;
+
+
+/* 一回の実行。
+ * 交叉と選択の方法、乱数生成器、出力先を実行毎に持つので、複数の実行を並列に動かしても互いに干渉しない。 */
+typedef struct {
+	int cross_type;  /* 交叉のタイプ。CROSS_*のいずれか。 */
+	int choice_type;  /* 選択のタイプ。CHOICE_*のいずれか。 */
+	unsigned long seed;  /* 乱数の種 */
+	Random random;  /* この実行の乱数生成器 */
+	FILE *output;  /* 世代の情報の表示先 */
+	FILE *normal_log;  /* 課題用のログファイル。NULLなら記録しない。 */
+	FILE *advance_log;  /* 拡張ログファイル。NULLなら記録しない。 */
+	int log_interval;  /* ログに記録する間隔 (世代数) */
+	int generation_num;  /* 実行を終えたときの世代数 */
+	int best_fitness;  /* 実行を終えたときの最も高い適応度 */
+	const FitnessFunction *fitness;  /* 適応度関数 */
+	FitnessPool *pool;  /* 適応度を並列に計算するスレッドプール。NULLなら呼び出したスレッドだけで計算する。 */
+	FitnessCache *cache;  /* 適応度のキャッシュ。NULLなら毎回計算する。複数の実行で共有してよい。 */
+	Checkpointer *checkpointer;  /* チェックポイントの書き込み器。NULLならチェックポイントを取らない。 */
+	int checkpoint_interval;  /* チェックポイントを取る間隔 (世代数) */
+	const Checkpoint *resume;  /* 再開するチェックポイント。NULLなら第一世代から始める。 */
+	int full_evaluation;  /* 0以外なら適応度関数にdeltaがあっても使わない */
+	GeneDelta *deltas;  /* 次の世代の各遺伝子の変化。差分計算をしないときはNULL。 */
+} RunContext;
+
+
+/** 実行の初期化
+ * 実行の設定を決め、乱数生成器を初期化する。
+ * 適応度はスレッドプールとキャッシュを使わずに計算し、ログは毎世代記録し、チェックポイントは取らない。
+ * 変えるときは後でpool、cache、log_interval、checkpointerなどを設定すること。
+ *
+ * context: 初期化する実行。
+ * fitness: 適応度関数。
+ * cross_type: 交叉のタイプ。
+ * choice_type: 選択のタイプ。
+ * seed: 乱数の種。
+ * output: 世代の情報の表示先。
+ * normal_log: 課題用のログファイル。NULLなら記録しない。
+ * advance_log: 拡張ログファイル。NULLなら記録しない。
+ */
+void init_context(
+		RunContext *context,
+		const FitnessFunction *fitness,
+		const int cross_type,
+		const int choice_type,
+		const unsigned long seed,
+		FILE *output,
+		FILE *normal_log,
+		FILE *advance_log
+){
+	context->cross_type = cross_type;
+	context->choice_type = choice_type;
+	context->seed = seed;
+	seed_random(&context->random, seed);
+	context->output = output;
+	context->normal_log = normal_log;
+	context->advance_log = advance_log;
+	context->log_interval = 1;
+	context->generation_num = 0;
+	context->best_fitness = 0;
+	context->fitness = fitness;
+	context->pool = NULL;
+	context->cache = NULL;
+	context->checkpointer = NULL;
+	context->checkpoint_interval = CHECKPOINT_INTERVAL;
+	context->resume = NULL;
+	context->full_evaluation = 0;
+	context->deltas = NULL;
+}
 
-	srand(time(NULL));  /* 乱数生成器の初期化 */
 
-	make_genes(genes);  /* 第一世代を生成 */
-	show_generation(0, (const int (*)[GENE_LENGTH])genes);  /* 作った世代を表示する */
-	printf("\n");
+/** 適応度の累積和を作る
+ * 世代の適応度から、ルーレット選択に使う適応度の累積和を作る。
+ *
+ * generation: 適応度を計算済みの世代。
+ */
+void accumulate_fitness(Generation *generation){
+	int sum = 0;
+	int i;
+
+	for(i=0; i<GENE_NUM; i++){
+		sum += generation->fitnesses[i];
+		generation->cumulative[i] = sum;
+	}
+}
 
-	write_log(log_file, adv_log_file, (const int (*)[GENE_LENGTH])genes);
 
-#ifdef STOP_WHEN_DONE
-	for(i=0; i<LOOP_NUM && calc_fitness(find_max_fitness(genes))<GENE_LENGTH; i++){
-#else
-	for(i=0; i<LOOP_NUM; i++){
-#endif
-		/* 次の世代の遺伝子を生成する。 */
-		for(j=1; j<GENE_NUM; j++){
-			cross(
-				choice((const int (*)[GENE_LENGTH])genes),
-				choice((const int (*)[GENE_LENGTH])genes),
-				next[j]
-			);
-		}
+/** 遺伝子の適応度を計算する
+ * num個の遺伝子の適応度を実行の適応度関数で計算する。
+ * 実行にスレッドプールがあれば、適応度は並列に計算する。
+ *
+ * context: 適応度関数とスレッドプールを持つ実行。
+ * genes: 計算したい遺伝子の配列。
+ * fitnesses: 計算した適応度の保存先。
+ * num: 遺伝子の数。GENE_NUM以下。
+ */
+void evaluate_genes(RunContext *context, const GeneWord genes[][GENE_WORDS], int fitnesses[], const int num){
+	if(context->pool != NULL){
+		evaluate_parallel(context->pool, context->fitness, genes, fitnesses, num);
+	}else{
+		context->fitness->evaluate(genes, fitnesses, num);
+	}
+}
 
-		mutation(next);  /* 突然変異を起こす。 */
 
-		memcpy(next[0], find_max_fitness((const int (*)[GENE_LENGTH])genes), GENE_LENGTH * sizeof(int));  /* 最も優秀な遺伝子を次の世代にコピーする。 */
+/** キャッシュを使って適応度を計算する
+ * 世代の遺伝子のうちキャッシュに無いものだけを集めて計算し、結果をキャッシュに入れる。
+ * 同じ世代に同じ遺伝子がいくつあっても、計算するのは一度だけにする。
+ *
+ * context: 適応度関数とキャッシュを持つ実行。
+ * generation: 計算したい世代。
+ */
+void evaluate_cached(RunContext *context, Generation *generation){
+	GeneWord misses[GENE_NUM][GENE_WORDS];  /* キャッシュに無かった遺伝子 */
+	int miss_fitnesses[GENE_NUM];  /* キャッシュに無かった遺伝子の適応度 */
+	uint64_t hashes[GENE_NUM];  /* 各遺伝子のハッシュ値 */
+	int sources[GENE_NUM];  /* 各遺伝子の適応度を取るmissesの番号。キャッシュにあれば-1。 */
+	int slots[GENE_NUM * 2];  /* 同じ世代の同じ遺伝子を探す表。遺伝子の番号を入れ、空きは-1。 */
+	int miss_num = 0;
+	int i, k;
+
+	for(k=0; k<GENE_NUM*2; k++){
+		slots[k] = -1;
+	}
 
-		memcpy(genes, next, sizeof(genes));  /* 新しい世代をコピーする。 */
+	for(i=0; i<GENE_NUM; i++){
+		hashes[i] = hash_gene(generation->genes[i]);
+		sources[i] = -1;
+		if(lookup_fitness_cache(context->cache, hashes[i], generation->genes[i], &generation->fitnesses[i])){
+			continue;
+		}
 
-#ifdef SHOW_VERBOSE
-		/* 新しく出来た世代の遺伝子を表示。 */
-		show_generation(i, (const int (*)[GENE_LENGTH])genes);
-		printf("\n");
-#endif
+		/* この世代で先に出てきた同じ遺伝子を探し、無ければ計算するものに加える。 */
+		for(k=(int)(hashes[i] % (GENE_NUM*2)); slots[k]>=0; k=(k + 1) % (GENE_NUM*2)){
+			if(hashes[slots[k]] == hashes[i] && memcmp(generation->genes[slots[k]], generation->genes[i], GENE_WORDS * sizeof(GeneWord)) == 0){
+				break;
+			}
+		}
+		if(slots[k] >= 0){
+			sources[i] = sources[slots[k]];
+		}else{
+			slots[k] = i;
+			sources[i] = miss_num;
+			memcpy(misses[miss_num], generation->genes[i], GENE_WORDS * sizeof(GeneWord));
+			miss_num++;
+		}
+	}
 
-		write_log(log_file, adv_log_file, (const int (*)[GENE_LENGTH])genes);
+	if(miss_num > 0){
+		evaluate_genes(context, (const GeneWord (*)[GENE_WORDS])misses, miss_fitnesses, miss_num);
 	}
 
-#ifndef SHOW_VERBOSE
-	/* 計算結果を表示。 */
-	show_generation(i, (const int (*)[GENE_LENGTH])genes);
-#endif
+	for(i=0; i<GENE_NUM; i++){
+		if(sources[i] >= 0){
+			generation->fitnesses[i] = miss_fitnesses[sources[i]];
+		}
+	}
+	for(k=0; k<GENE_NUM*2; k++){
+		if(slots[k] >= 0){
+			insert_fitness_cache(context->cache, hashes[slots[k]], generation->genes[slots[k]], generation->fitnesses[slots[k]]);
+		}
+	}
+}
+
+
+/** 適応度をまとめて計算する
+ * 世代の全ての遺伝子の適応度を実行の適応度関数で計算し、ルーレット選択に使う適応度の累積和も作る。
+ * 実行にスレッドプールがあれば、適応度は並列に計算する。
+ * 実行にキャッシュがあれば、キャッシュにある遺伝子は計算しない。
+ * 遺伝子を変更したら、選択や表示の前に必ず呼び出すこと。
+ *
+ * context: 適応度関数とスレッドプールを持つ実行。
+ * generation: 計算したい世代。
+ */
+void evaluate_generation(RunContext *context, Generation *generation){
+	if(context->cache != NULL){
+		evaluate_cached(context, generation);
+	}else{
+		evaluate_genes(context, (const GeneWord (*)[GENE_WORDS])generation->genes, generation->fitnesses, GENE_NUM);
+	}
+
+	accumulate_fitness(generation);
+}
+
+
+/** 差分を記録する
+ * 子の遺伝子のword語目でmaskのビットが反転したことを記録する。
+ * 覚えておける語の数を超えたら、それ以降は差分を追わずに全体を計算し直す印を付ける。
+ *
+ * delta: 記録先の子の変化。
+ * word: 反転した語の番号。
+ * mask: 反転したビット。
+ */
+void record_change(GeneDelta *delta, const int word, const GeneWord mask){
+	if(mask == 0){
+		return;
+	}
+	if(delta->changed[word] == 0 && delta->touched_num <= DELTA_TOUCHED_SIZE){
+		if(delta->touched_num < DELTA_TOUCHED_SIZE){
+			delta->touched[delta->touched_num] = word;
+		}
+		delta->touched_num++;
+	}
+	delta->changed[word] ^= mask;
+}
+
+
+/** 差分を消す
+ * 子の変化の記録を空にする。touchedの語だけを0に戻す。
+ *
+ * delta: 消したい子の変化。
+ */
+void clear_delta(GeneDelta *delta){
+	int i;
+
+	if(delta->touched_num > DELTA_TOUCHED_SIZE){
+		memset(delta->changed, 0, sizeof(delta->changed));
+	}else{
+		for(i=0; i<delta->touched_num; i++){
+			delta->changed[delta->touched[i]] = 0;
+		}
+	}
+	delta->touched_num = 0;
+}
+
+
+/** 適応度を差分から計算する
+ * 世代の全ての遺伝子の適応度を、親の適応度と記録した変化から適応度関数のdeltaで計算し、累積和も作る。
+ * 一つの子の手間は遺伝子の長さではなく変化した語の数に比例する。
+ * 変化を追い切れなかった子だけは、適応度関数のevaluateで計算し直す。
+ * 計算した後は、次の世代のために変化の記録を空にしておく。
+ *
+ * context: 適応度関数と変化の記録を持つ実行。
+ * generation: 計算したい世代。
+ */
+void evaluate_delta(RunContext *context, Generation *generation){
+	GeneChange changes[DELTA_TOUCHED_SIZE];  /* 変化した語の一覧 */
+	GeneDelta *delta;
+	int change_num;
+	int i, k, word;
+
+	for(i=0; i<GENE_NUM; i++){
+		delta = &context->deltas[i];
+
+		if(delta->touched_num > DELTA_TOUCHED_SIZE){
+			clear_delta(delta);
+			context->fitness->evaluate((const GeneWord (*)[GENE_WORDS])generation->genes + i, generation->fitnesses + i, 1);
+			continue;
+		}
+
+		/* 変化が0に戻った語や重複を除いて一覧にし、記録を消す。 */
+		change_num = 0;
+		for(k=0; k<delta->touched_num; k++){
+			word = delta->touched[k];
+			if(delta->changed[word] != 0){
+				changes[change_num].word = word;
+				changes[change_num].mask = delta->changed[word];
+				change_num++;
+				delta->changed[word] = 0;
+			}
+		}
+		delta->touched_num = 0;
+
+		generation->fitnesses[i] = context->fitness->delta(generation->genes[i], changes, change_num, delta->base_fitness);
+	}
+
+	accumulate_fitness(generation);
+}
+
+
+/** 適応度の合計を計算する
+ * 世代のすべての遺伝子の適応度の合計を返す。
+ *
+ * generation: 計算したい世代。
+ *
+ * return: 全ての遺伝子の適応度の合計。
+ */
+int sum_fitness(const Generation *generation){
+	return generation->cumulative[GENE_NUM-1];
+}
+
+
+/** 交叉に使う個体をランダムに一つ選ぶ
+ * 交叉に使用する個体をランダムに一つ選ぶ。
+ * 選択の方法は実行のchoice_typeによって決まる。
+ *
+ * ルーレット方式では、0から適応度の合計未満までの乱数を選び、適応度の累積和がそれを超える最初の個体を二分探索で探す。
+ * 各個体は適応度に比例した確率で選ばれる。全ての適応度が0なら、どの個体も同じ確率で選ばれる。
+ *
+ * context: 実行の設定と乱数生成器。
+ * generation: 選ぶ元の世代。
+ *
+ * return: 選ばれた遺伝子の番号。
+ */
+int choice(RunContext *context, const Generation *generation){
+	int lo = 0, hi = GENE_NUM-1, mid;
+	int select;
+	int a, b;
+
+	if(context->choice_type == CHOICE_ROULETTE){
+		if(sum_fitness(generation) == 0){
+			return random_int(&context->random, GENE_NUM);
+		}
+
+		select = random_int(&context->random, sum_fitness(generation));
+		while(lo < hi){
+			mid = (lo + hi) / 2;
+			if(generation->cumulative[mid] > select){
+				hi = mid;
+			}else{
+				lo = mid + 1;
+			}
+		}
+
+		return lo;
+	}
+
+	a = random_int(&context->random, GENE_NUM);  /* 一つめの候補は適当に決める。 */
+
+	/* 二つめの候補は一つめと被らないように決める。 */
+	do{
+		b = random_int(&context->random, GENE_NUM);
+	}while(a == b);
+
+	/* 適応度の高い方を選ぶ。 */
+	if(generation->fitnesses[a] > generation->fitnesses[b]){
+		return a;
+	}else{
+		return b;
+	}
+}
+
+
+/** 適応度が最も高い個体を探す
+ * 世代の遺伝子のうち、適応度が最も高い個体を探す。
+ *
+ * generation: 探したい世代。
+ *
+ * return: 最も適応度が高い遺伝子の番号。
+ */
+int find_max_fitness(const Generation *generation){
+	int i, max_idx=0;
+
+	for(i=1; i<GENE_NUM; i++){
+		if(generation->fitnesses[i] > generation->fitnesses[max_idx]){
+			max_idx = i;
+		}
+	}
+
+	return max_idx;
+}
+
+
+/** 適応度が最も低い個体を探す
+ * 世代の遺伝子のうち、適応度が最も低い個体を探す。
+ *
+ * generation: 探したい世代。
+ *
+ * return: 最も適応度が低い遺伝子の番号。
+ */
+int find_min_fitness(const Generation *generation){
+	int i, min_idx=0;
+
+	for(i=1; i<GENE_NUM; i++){
+		if(generation->fitnesses[i] < generation->fitnesses[min_idx]){
+			min_idx = i;
+		}
+	}
+
+	return min_idx;
+}
+
+
+/** 二つの遺伝子を交叉させて新たな遺伝子を作る
+ * 引数で与えられた二つの遺伝子を交叉させて新たな遺伝子を作り、引数childに格納する。
+ * 交叉の方法は実行のcross_typeによって決定される。
+ * どの方法でも、aから受け継ぐビットを1にしたマスクを語毎に作り、一語ずつまとめて混ぜ合わせる。
+ *
+ * deltaがNULLでなければ、子が多く受け継いだ方の親を元にして、もう一方の親から受け継いだ範囲の語の変化を記録する。
+ *
+ * context: 実行の設定と乱数生成器。
+ * a: 一つめの親。
+ * b: 二つめの親。
+ * child: 生成した子供を保存する先。
+ * delta: 子の変化の記録先。NULLなら記録しない。
+ *
+ * return: 変化の元にした親。aなら0、bなら1。
+ */
+int cross(
+		RunContext *context,
+		const GeneWord a[GENE_WORDS],
+		const GeneWord b[GENE_WORDS],
+		GeneWord child[GENE_WORDS],
+		GeneDelta *delta
+){
+	GeneWord mask;
+	int pivot_a, pivot_b;
+	int base = 0;  /* 変化の元にした親 */
+	int first = 0, last = GENE_WORDS-1;  /* もう一方の親から受け継いだかもしれない語の範囲 */
+	int i;
+
+	switch(context->cross_type){
+	case CROSS_ONE_POINT:
+		pivot_a = random_int(&context->random, GENE_LENGTH-2) + 1;
+
+		for(i=0; i<GENE_WORDS; i++){
+			mask = range_mask(i, 0, pivot_a);
+			child[i] = (a[i] & mask) | (b[i] & ~mask);
+		}
+
+		if(pivot_a*2 >= GENE_LENGTH){
+			first = pivot_a / WORD_BITS;
+		}else{
+			base = 1;
+			last = (pivot_a - 1) / WORD_BITS;
+		}
+		break;
+	case CROSS_TWO_POINT:
+		pivot_b = random_int(&context->random, GENE_LENGTH-3) + 2;
+		pivot_a = random_int(&context->random, pivot_b) + 1;
+
+		for(i=0; i<GENE_WORDS; i++){
+			mask = ~range_mask(i, pivot_a, pivot_b + 1);
+			child[i] = (a[i] & mask) | (b[i] & ~mask);
+		}
+
+		if((pivot_b + 1 - pivot_a)*2 <= GENE_LENGTH){
+			first = pivot_a / WORD_BITS;
+			last = pivot_b / WORD_BITS;
+		}else{
+			/* bを元にすると、変化するのはpivot_aより前とpivot_bより後の二つの範囲になる。 */
+			base = 1;
+			last = (pivot_a - 1) / WORD_BITS;
+			if(delta != NULL){
+				for(i=(pivot_b + 1) / WORD_BITS > last ? (pivot_b + 1) / WORD_BITS : last + 1; i<GENE_WORDS; i++){
+					record_change(delta, i, child[i] ^ b[i]);
+				}
+			}
+		}
+		break;
+	default:
+		for(i=0; i<GENE_WORDS; i++){
+			mask = random_word(&context->random);
+			child[i] = (a[i] & mask) | (b[i] & ~mask);
+		}
+		break;
+	}
+
+	if(delta != NULL){
+		for(i=first; i<=last; i++){
+			record_change(delta, i, child[i] ^ (base == 0 ? a[i] : b[i]));
+		}
+	}
+
+	return base;
+}
+
+
+/** 確率pで1になるビットのマスクを作る
+ * 各ビットが独立に確率probability / 2^MUTATION_PRECISIONで1になる語を作る。
+ * 確率の2進表現を下位から見ていき、ビットが1なら乱数の語と論理和を、0なら論理積を取る。
+ * 一語分のマスクに使う乱数は最大でもMUTATION_PRECISION語なので、ビット毎に乱数を引くより速い。
+ *
+ * random: 使用する乱数生成器。
+ * probability: 1になる確率を2^MUTATION_PRECISION倍した値。
+ *
+ * return: 作ったマスク。
+ */
+GeneWord random_mask(Random *random, const unsigned long probability){
+	GeneWord mask = 0;
+	int i;
+
+	for(i=0; i<MUTATION_PRECISION; i++){
+		if(probability >> i & 1){
+			mask |= random_word(random);
+		}else if(mask != 0){  /* 最下位の1より下の桁は0のままなので飛ばす */
+			mask &= random_word(random);
+		}
+	}
+
+	return mask;
+}
+
+
+/** 突然変異を発生させる
+ * 与えられた遺伝子の配列全体について、定数MUTATION_RATEの確率で突然変異を起こす。
+ *
+ * MUTATION_RATEがMUTATION_SKIP_RATE未満のときは、全ての遺伝子のビットを一列に並べたものとみなし、
+ * 次に反転するビットまでの間隔を幾何分布から直接引く。一様乱数Uに対して、間隔はfloor(log(1-U) / log(1-MUTATION_RATE))になる。
+ * ビット毎に乱数を引くのではないので、計算量は遺伝子の長さではなく突然変異の回数に比例する。
+ *
+ * 突然変異が多いときは反転一回ごとのlogの方が高くつくので、random_maskで反転するビットのマスクを語毎にまとめて作る。
+ *
+ * deltasがNULLでなければ、反転したビットを各遺伝子の変化に記録する。
+ *
+ * random: 使用する乱数生成器。
+ * genes: 突然変異を起こしたい遺伝子の配列。
+ * deltas: 各遺伝子の変化の記録先。NULLなら記録しない。
+ */
+void mutation(Random *random, GeneWord genes[GENE_NUM][GENE_WORDS], GeneDelta deltas[GENE_NUM]){
+	GeneWord mask;
+	const long total = (long)GENE_NUM * GENE_LENGTH;  /* 全体のビット数 */
+	double log_keep;  /* ビットが反転しない確率の対数 */
+	double skip;  /* 次に反転するビットまでに飛ばすビットの数 */
+	long position = -1;  /* 最後に反転したビットの位置 */
+	int i, j, k;
+
+	if(MUTATION_RATE <= 0){
+		return;
+	}
+
+	if(MUTATION_RATE >= MUTATION_SKIP_RATE){
+		for(i=0; i<GENE_NUM; i++){
+			for(j=0; j<GENE_WORDS; j++){
+				if(MUTATION_RATE >= 1){
+					mask = range_mask(j, 0, GENE_LENGTH);
+				}else{
+					mask = random_mask(random, (unsigned long)(MUTATION_RATE * (1L << MUTATION_PRECISION) + 0.5)) & range_mask(j, 0, GENE_LENGTH);
+				}
+				genes[i][j] ^= mask;
+				if(deltas != NULL){
+					record_change(&deltas[i], j, mask);
+				}
+			}
+		}
+		return;
+	}
+
+	log_keep = log(1.0 - MUTATION_RATE);
+	for(;;){
+		skip = log(1.0 - random_double(random)) / log_keep;
+		if(skip >= (double)(total - position - 1)){
+			break;
+		}
+		position += (long)skip + 1;
+
+		i = (int)(position / GENE_LENGTH);
+		k = (int)(position % GENE_LENGTH);
+		genes[i][k / WORD_BITS] ^= (GeneWord)1 << (k % WORD_BITS);
+		if(deltas != NULL){
+			record_change(&deltas[i], k / WORD_BITS, (GeneWord)1 << (k % WORD_BITS));
+		}
+	}
+}
+
+
+/** 遺伝子情報を表示する
+ * 一つの遺伝子の情報を表示する。
+ * 表示に使用する文字は定数TRUE_BITとFALSE_BITによって定義される。
+ * また、遺伝子の中央にはSPLIT_BITが表示される。
+ * いずれの定数も文字列で、任意の長さを設定出来る。
+ *
+ * output: 表示先のファイルポインタ。
+ * gene: 表示したい遺伝子。
+ * fitness: 遺伝子の適応度。
+ */
+void show_gene(FILE *output, const GeneWord gene[GENE_WORDS], const int fitness){
+	int i;
+
+	for(i=0; i<GENE_LENGTH; i++){
+		if(i == GENE_LENGTH/2){
+			fprintf(output, "%s", SPLIT_BIT(output));
+		}
+		fprintf(output, "%s", GENE_BIT(gene, i) ? TRUE_BIT(output) : FALSE_BIT(output));
+	}
+	fprintf(output, " (%d%%)\n", fitness*100/GENE_LENGTH);
+}
+
+
+/** 一世代の情報を表示する
+ * 一世代全ての遺伝子の情報を表示する。
+ * show_gene関数で表示される情報に加え、その世代における最大、最小、平均などの値も表示される。
+ *
+ * output: 表示先のファイルポインタ。
+ * generation_id: 何世代目かを表わす番号。表示に使われるだけ。ゼロオリジンを想定している（=表示の時に+1される）ので注意。
+ * generation: 表示したい世代。
+ */
+void show_generation(FILE *output, const int generation_id, const Generation *generation){
+	int i;
+
+	for(i=0; i<GENE_NUM; i++){
+		show_gene(output, generation->genes[i], generation->fitnesses[i]);
+	}
+
+	fprintf(output, "generation: %d\n", generation_id + 1);
+	fprintf(output, "max: %d%%\n", generation->fitnesses[find_max_fitness(generation)]*100/GENE_LENGTH);
+	fprintf(output, "min: %d%%\n", generation->fitnesses[find_min_fitness(generation)]*100/GENE_LENGTH);
+	fprintf(output, "average: %d%%\n", sum_fitness(generation)*100/GENE_NUM/GENE_LENGTH);
+}
+
+
+/* 一世代の適応度の統計。
+ * 適応度は0以上GENE_LENGTH以下の整数なので、適応度毎の個体の数を数えたヒストグラムを一度作れば、
+ * 並べ替えをしなくても最大、最小、中央値などの任意の分位数を読み出せる。 */
+typedef struct {
+	int counts[GENE_LENGTH + 1];  /* counts[f]は適応度がfの遺伝子の数 */
+	int num;  /* 数えた遺伝子の数 */
+} FitnessStats;
+
+
+/** 適応度の統計を取る
+ * 世代の適応度を一度だけ走査して、ヒストグラムを作る。
+ *
+ * stats: 統計の保存先。
+ * generation: 統計を取りたい世代。
+ */
+void collect_stats(FitnessStats *stats, const Generation *generation){
+	int i;
+
+	memset(stats->counts, 0, sizeof(stats->counts));
+	for(i=0; i<GENE_NUM; i++){
+		stats->counts[generation->fitnesses[i]]++;
+	}
+	stats->num = GENE_NUM;
+}
+
+
+/** 適応度の分位数
+ * 適応度を小さい順に並べたときのfloor(q * (num-1))番目の値を、ヒストグラムから読み出す。
+ * qが0なら最小値、1なら最大値、0.5なら中央値 (個体が偶数のときは小さい方) になる。
+ *
+ * stats: collect_statsで作った統計。
+ * q: 0以上1以下の分位。
+ *
+ * return: 分位数にあたる適応度。
+ */
+int stats_quantile(const FitnessStats *stats, const double q){
+	const int rank = (int)(q * (stats->num - 1));  /* 小さい方から何番目か */
+	int fitness, seen = 0;
+
+	for(fitness=0; fitness<GENE_LENGTH; fitness++){
+		seen += stats->counts[fitness];
+		if(seen > rank){
+			break;
+		}
+	}
+
+	return fitness;
+}
+
+
+/** ログファイルに一世代分の情報を追記する
+ * 二種類のログファイルに一世代分の情報を追記する。
+ *
+ * normalログには講義で指示された基本的な内容が記録される。
+ * advanceログにはその世代における最大、最小、平均、中央値が記録される。
+ * 最大、最小、中央値は適応度のヒストグラムから読み出す (FitnessStats参照)。
+ *
+ * ログファイルがNULLのときはそのログには記録しない。
+ *
+ * context: 記録先のログファイルを持つ実行。
+ * generation_id: 何世代目か。normalログに記録する。ワンオリジン。
+ * generation: 記録したい世代。
+ */
+void write_log(RunContext *context, const int generation_id, const Generation *generation){
+	FitnessStats stats;
+	double avg;
+
+	collect_stats(&stats, generation);
+	avg = (double)sum_fitness(generation)/GENE_NUM;
+
+	if(context->normal_log != NULL){
+		fprintf(context->normal_log, "%d %lf %d\n", generation_id, avg, stats_quantile(&stats, 1.0));
+	}
+	if(context->advance_log != NULL){
+		fprintf(
+			context->advance_log,
+			"%lf %lf %lf %lf\n",
+			avg/GENE_LENGTH,
+			(double)stats_quantile(&stats, 1.0)/GENE_LENGTH,
+			(double)stats_quantile(&stats, 0.0)/GENE_LENGTH,
+			(double)stats_quantile(&stats, 0.5)/GENE_LENGTH
+		);
+	}
+}
+
+
+/** チェックポイントの書き込み
+ * チェックポイントをファイルに書き込む。
+ * 途中で止まっても前のチェックポイントが壊れないように、一時ファイルに書いてから名前を変える。
+ *
+ * fname: 書き込み先のファイル名。
+ * checkpoint: 書き込むチェックポイント。
+ */
+void save_checkpoint(const char *fname, const Checkpoint *checkpoint){
+	char *temp = malloc(strlen(fname) + 5);
+	FILE *fp;
+
+	sprintf(temp, "%s.tmp", fname);
+	if((fp = fopen(temp, "wb")) == NULL){
+		printf("save_checkpoint(): Cannot open \"%s\"\n", temp);
+		exit(1);
+	}
+
+	fwrite(&checkpoint->header, sizeof(CheckpointHeader), 1, fp);
+	fwrite(checkpoint->genes, sizeof(GeneWord), GENE_NUM * GENE_WORDS, fp);
+
+	if(ferror(fp) || fclose(fp) != 0){
+		printf("save_checkpoint(): Cannot write \"%s\"\n", temp);
+		exit(1);
+	}
+	if(rename(temp, fname) != 0){
+		printf("save_checkpoint(): Cannot rename \"%s\" to \"%s\"\n", temp, fname);
+		exit(1);
+	}
+	free(temp);
+}
+
+
+/** チェックポイントの読み込み
+ * save_checkpointで書き込んだファイルからチェックポイントを読み込む。
+ * 遺伝子の長さや数がこのプログラムと違うファイルは読み込めない。
+ *
+ * fname: 読み込むファイル名。
+ * checkpoint: 読み込んだチェックポイントの保存先。
+ */
+void load_checkpoint(const char *fname, Checkpoint *checkpoint){
+	CheckpointHeader *header = &checkpoint->header;
+	FILE *fp;
+
+	if((fp = fopen(fname, "rb")) == NULL){
+		printf("load_checkpoint(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+
+	if(fread(header, sizeof(CheckpointHeader), 1, fp) != 1
+	|| memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+	|| header->version != CHECKPOINT_VERSION
+	|| header->gene_length != GENE_LENGTH
+	|| header->gene_num != GENE_NUM
+	|| header->cross_type < 0 || header->cross_type >= (int)CROSS_TYPE_NUM
+	|| header->choice_type < 0 || header->choice_type >= (int)CHOICE_TYPE_NUM
+	|| header->fitness < 0 || header->fitness >= (int)FITNESS_FUNCTION_NUM
+	|| header->log_interval < 1 || header->generation < 0){
+		printf("load_checkpoint(): \"%s\" is not a checkpoint for this program\n", fname);
+		exit(1);
+	}
+	if(fread(checkpoint->genes, sizeof(GeneWord), GENE_NUM * GENE_WORDS, fp) != GENE_NUM * GENE_WORDS){
+		printf("load_checkpoint(): \"%s\" is truncated\n", fname);
+		exit(1);
+	}
+
+	fclose(fp);
+}
+
+
+/** チェックポイントを書き込むスレッド
+ * チェックポイントが来るのを待ち、来たら写し取ってから、ロックを外してファイルに書き込む。
+ *
+ * arg: チェックポイントの書き込み器 (Checkpointer)。
+ *
+ * return: 常にNULL。
+ */
+void* checkpoint_thread(void *arg){
+	Checkpointer *checkpointer = (Checkpointer*)arg;
+
+	for(;;){
+		pthread_mutex_lock(&checkpointer->mutex);
+		while(!checkpointer->has_pending && !checkpointer->quit){
+			pthread_cond_wait(&checkpointer->ready, &checkpointer->mutex);
+		}
+		if(!checkpointer->has_pending){
+			pthread_mutex_unlock(&checkpointer->mutex);
+			break;
+		}
+		memcpy(&checkpointer->writing, &checkpointer->pending, sizeof(Checkpoint));
+		checkpointer->has_pending = 0;
+		pthread_mutex_unlock(&checkpointer->mutex);
+
+		save_checkpoint(checkpointer->fname, &checkpointer->writing);
+	}
+
+	return NULL;
+}
+
+
+/** チェックポイントの書き込み器の初期化
+ * チェックポイントを書き込むスレッドを作る。
+ *
+ * checkpointer: 初期化する書き込み器。
+ * fname: チェックポイントの書き込み先のファイル名。
+ */
+void init_checkpointer(Checkpointer *checkpointer, const char *fname){
+	pthread_mutex_init(&checkpointer->mutex, NULL);
+	pthread_cond_init(&checkpointer->ready, NULL);
+	checkpointer->fname = fname;
+	checkpointer->has_pending = 0;
+	checkpointer->quit = 0;
+	pthread_create(&checkpointer->thread, NULL, checkpoint_thread, checkpointer);
+}
+
+
+/** チェックポイントの書き込み器の解放
+ * 書き込みを待っているチェックポイントを書き終えてから、スレッドを終了させる。
+ *
+ * checkpointer: 解放する書き込み器。
+ */
+void free_checkpointer(Checkpointer *checkpointer){
+	pthread_mutex_lock(&checkpointer->mutex);
+	checkpointer->quit = 1;
+	pthread_cond_signal(&checkpointer->ready);
+	pthread_mutex_unlock(&checkpointer->mutex);
+	pthread_join(checkpointer->thread, NULL);
+
+	pthread_cond_destroy(&checkpointer->ready);
+	pthread_mutex_destroy(&checkpointer->mutex);
+}
+
+
+/** ログの書き込み位置
+ * ログファイルのバッファを書き出してから、書き込み位置を返す。
+ * チェックポイントに記録した位置までは、プロセスが止まってもファイルに残っている。
+ *
+ * fp: ログファイル。NULLでもよい。
+ *
+ * return: 書き込み位置。fpがNULLなら-1。
+ */
+long log_position(FILE *fp){
+	if(fp == NULL){
+		return -1;
+	}
+	fflush(fp);
+	return ftell(fp);
+}
+
+
+/** チェックポイントを取る
+ * 実行の今の状態をチェックポイントにして、書き込み器に渡す。ファイルへの書き込みは待たない。
+ *
+ * context: チェックポイントを取る実行。
+ * generation_count: 終えた世代の計算の回数。
+ * generation: 今の世代。
+ */
+void take_checkpoint(RunContext *context, const int generation_count, const Generation *generation){
+	Checkpointer *checkpointer = context->checkpointer;
+	CheckpointHeader *header = &checkpointer->pending.header;
+	const long normal_position = log_position(context->normal_log);
+	const long advance_position = log_position(context->advance_log);
+
+	pthread_mutex_lock(&checkpointer->mutex);
+
+	memset(header, 0, sizeof(CheckpointHeader));
+	memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+	header->version = CHECKPOINT_VERSION;
+	header->gene_length = GENE_LENGTH;
+	header->gene_num = GENE_NUM;
+	header->cross_type = context->cross_type;
+	header->choice_type = context->choice_type;
+	header->fitness = (int)(context->fitness - FITNESS_FUNCTIONS);
+	header->log_interval = context->log_interval;
+	header->generation = generation_count;
+	header->seed = context->seed;
+	header->random_state = context->random.state;
+	header->normal_log_position = normal_position;
+	header->advance_log_position = advance_position;
+	memcpy(checkpointer->pending.genes, generation->genes, sizeof(checkpointer->pending.genes));
+
+	checkpointer->has_pending = 1;
+	pthread_cond_signal(&checkpointer->ready);
+	pthread_mutex_unlock(&checkpointer->mutex);
+}
+
+
+/** ログファイルを再開用に開く
+ * ログファイルをチェックポイントに記録した位置で切り詰め、その後ろに追記できるように開く。
+ *
+ * fname: ログファイルの名前。
+ * position: チェックポイントに記録した書き込み位置。
+ *
+ * return: 開いたファイルポインタ。
+ */
+FILE* reopen_log(const char *fname, const long position){
+	FILE *fp;
+
+	if((fp = fopen(fname, "r+")) == NULL){
+		printf("reopen_log(): Cannot open \"%s\"\n", fname);
+		exit(1);
+	}
+	if(position < 0 || ftruncate(fileno(fp), position) != 0 || fseek(fp, position, SEEK_SET) != 0){
+		printf("reopen_log(): Cannot seek \"%s\" to %ld\n", fname, position);
+		exit(1);
+	}
+
+	return fp;
+}
+
+
+/** 次の世代を作る
+ * 今の世代から選択と交叉で次の世代を作り、突然変異を起こす。
+ * 最も優秀な遺伝子はそのまま次の世代の0番目にコピーし、最後に次の世代の適応度を計算する。
+ * 実行に変化の記録 (deltas) があれば、交叉と突然変異で変化したビットを記録し、適応度は差分から計算する。
+ *
+ * context: 実行の設定と乱数生成器。
+ * current: 今の世代。
+ * next: 作った世代の保存先。
+ */
+void next_generation(RunContext *context, const Generation *current, Generation *next){
+	GeneDelta *delta = NULL;
+	int parents[2];  /* 交叉する二つの親の番号 */
+	int j, best;
+
+	/* 次の世代の遺伝子を生成する。 */
+	for(j=1; j<GENE_NUM; j++){
+		parents[1] = choice(context, current);
+		parents[0] = choice(context, current);
+		if(context->deltas != NULL){
+			delta = &context->deltas[j];
+		}
+		parents[0] = parents[cross(context, current->genes[parents[0]], current->genes[parents[1]], next->genes[j], delta)];
+		if(delta != NULL){
+			delta->base_fitness = current->fitnesses[parents[0]];
+		}
+	}
+
+	mutation(&context->random, next->genes, context->deltas);  /* 突然変異を起こす。 */
+
+	best = find_max_fitness(current);
+	memcpy(next->genes[0], current->genes[best], GENE_WORDS * sizeof(GeneWord));  /* 最も優秀な遺伝子を次の世代にコピーする。 */
+
+	/* 新しい世代の適応度を一度だけ計算する。 */
+	if(context->deltas != NULL){
+		clear_delta(&context->deltas[0]);  /* 最も優秀な遺伝子は変化していない */
+		context->deltas[0].base_fitness = current->fitnesses[best];
+		evaluate_delta(context, next);
+	}else{
+		evaluate_generation(context, next);
+	}
+}
+
+
+/** 遺伝的アルゴリズムを一回実行する
+ * 第一世代を作り、交叉と突然変異を繰り返してLOOP_NUM世代まで計算する。
+ * STOP_WHEN_DONEが定義されていれば、最適解が出た時点で計算をやめる。
+ *
+ * 世代の情報は実行のoutputに表示し、ログは実行のログファイルに記録する。
+ * ログは第一世代からlog_interval世代毎と、最後の世代だけを記録する。
+ * 終えたときの世代数と最も高い適応度を実行のgeneration_numとbest_fitnessに保存する。
+ *
+ * 実行にチェックポイントの書き込み器があれば、checkpoint_interval世代毎にチェックポイントを取る。
+ * 実行にresumeがあれば、第一世代を作る代わりにその世代と乱数生成器の状態から計算を続ける。
+ * 乱数生成器の状態も戻すので、止まらずに計算した場合と全く同じ結果になる。
+ *
+ * 適応度関数にdeltaがあり、実行のfull_evaluationが0なら、第二世代からは適応度を差分から計算する。
+ *
+ * context: 実行する設定と出力先。
+ */
+void run_ga(RunContext *context){
+	Generation generations[2];  /* 今の世代と次の世代 */
+	Generation *current = &generations[0];
+	Generation *next = &generations[1];
+	Generation *swap;
+	int start = 0;  /* 最初の世代の計算の番号 */
+	int i;
+
+	if(context->fitness->delta != NULL && !context->full_evaluation){
+		context->deltas = calloc(GENE_NUM, sizeof(GeneDelta));
+	}
+
+	if(context->resume != NULL){
+		memcpy(current->genes, context->resume->genes, sizeof(current->genes));  /* チェックポイントの世代から再開 */
+		context->random.state = context->resume->header.random_state;
+		start = context->resume->header.generation;
+		evaluate_generation(context, current);
+	}else{
+		make_genes(&context->random, current->genes);  /* 第一世代を生成 */
+		evaluate_generation(context, current);
+		show_generation(context->output, 0, current);  /* 作った世代を表示する */
+		fprintf(context->output, "\n");
+
+		write_log(context, 1, current);
+	}
+
+#ifdef STOP_WHEN_DONE
+	for(i=start; i<LOOP_NUM && current->fitnesses[find_max_fitness(current)]<GENE_LENGTH; i++){
+#else
+	for(i=start; i<LOOP_NUM; i++){
+#endif
+		next_generation(context, current, next);
+
+		/* 新しい世代を今の世代にする。 */
+		swap = current;
+		current = next;
+		next = swap;
+
+#ifdef SHOW_VERBOSE
+		/* 新しく出来た世代の遺伝子を表示。 */
+		show_generation(context->output, i, current);
+		fprintf(context->output, "\n");
+#endif
+
+		if((i + 1) % context->log_interval == 0){
+			write_log(context, i + 2, current);
+		}
+
+		if(context->checkpointer != NULL && (i + 1) % context->checkpoint_interval == 0){
+			take_checkpoint(context, i + 1, current);
+		}
+	}
+	if(i % context->log_interval != 0){
+		write_log(context, i + 1, current);  /* 最後の世代は間隔によらず記録する。 */
+	}
+
+#ifndef SHOW_VERBOSE
+	/* 計算結果を表示。 */
+	show_generation(context->output, i, current);
+#endif
+
+	context->generation_num = i;
+	context->best_fitness = current->fitnesses[find_max_fitness(current)];
+
+	free(context->deltas);
+	context->deltas = NULL;
+}
+
+
+/* 比較実行の共有情報。
+ * 交叉と選択の全ての組み合わせと乱数の種の一つ一つを仕事とし、空いたスレッドが次の仕事を取っていく。 */
+typedef struct {
+	pthread_mutex_t mutex;  /* next_jobを守る */
+	int next_job;  /* 次に取る仕事の番号 */
+	int job_num;  /* 仕事の数 */
+	int seed_num;  /* 組み合わせ毎の実行の数 */
+	unsigned long seed;  /* 最初の実行の乱数の種。k番目の実行はseed+kを使う。 */
+	const char *directory;  /* 結果を保存するディレクトリ */
+	const FitnessFunction *fitness;  /* 適応度関数 */
+	FitnessCache *cache;  /* 全ての実行で共有する適応度のキャッシュ。NULLなら使わない。 */
+	int log_interval;  /* ログに記録する間隔 (世代数) */
+	RunContext *contexts;  /* 仕事毎の実行。添字が仕事の番号。 */
+} GridContext;
+
+
+/** 比較実行のファイル名を作る
+ * 比較実行の一つの仕事の結果を保存するファイル名を作る。
+ * 名前は"ディレクトリ/交叉-選択.拡張子"で、組み合わせ毎に複数回実行するときは"ディレクトリ/交叉-選択-番号.拡張子"になる。
+ *
+ * path: ファイル名の保存先。PATH_LENGTH文字以上の大きさが必要。
+ * grid: 比較実行の共有情報。
+ * job: 仕事の番号。
+ * extension: 拡張子。
+ */
+void grid_path(char *path, const GridContext *grid, const int job, const char *extension){
+	const int config = job / grid->seed_num;
+
+	if(grid->seed_num == 1){
+		sprintf(
+			path,
+			"%.900s/%s-%s.%s",
+			grid->directory,
+			CROSS_NAMES[config / CHOICE_TYPE_NUM],
+			CHOICE_NAMES[config % CHOICE_TYPE_NUM],
+			extension
+		);
+	}else{
+		sprintf(
+			path,
+			"%.900s/%s-%s-%d.%s",
+			grid->directory,
+			CROSS_NAMES[config / CHOICE_TYPE_NUM],
+			CHOICE_NAMES[config % CHOICE_TYPE_NUM],
+			job % grid->seed_num,
+			extension
+		);
+	}
+}
+
+
+/** 比較実行のスレッド
+ * 仕事が無くなるまで、次の仕事を取って実行する。
+ * 各仕事の表示は"名前.out"に、拡張ログは"名前.log"に保存する。課題用のログは記録しない。
+ *
+ * arg: 比較実行の共有情報 (GridContext)。
+ *
+ * return: 常にNULL。
+ */
+void* grid_thread(void *arg){
+	GridContext *grid = (GridContext*)arg;
+	RunContext *context;
+	char output_path[PATH_LENGTH], log_path[PATH_LENGTH];
+	FILE *output, *advance_log;
+	int job, config;
+
+	for(;;){
+		pthread_mutex_lock(&grid->mutex);
+		job = grid->next_job++;
+		pthread_mutex_unlock(&grid->mutex);
+		if(job >= grid->job_num){
+			break;
+		}
+
+		grid_path(output_path, grid, job, "out");
+		grid_path(log_path, grid, job, "log");
+		if((output = fopen(output_path, "w")) == NULL){
+			printf("grid_thread(): Cannot open \"%s\"\n", output_path);
+			exit(1);
+		}
+		if((advance_log = fopen(log_path, "w")) == NULL){
+			printf("grid_thread(): Cannot open \"%s\"\n", log_path);
+			exit(1);
+		}
+
+		config = job / grid->seed_num;
+		context = &grid->contexts[job];
+		init_context(
+			context,
+			grid->fitness,
+			config / CHOICE_TYPE_NUM,
+			config % CHOICE_TYPE_NUM,
+			grid->seed + job % grid->seed_num,
+			output,
+			NULL,
+			advance_log
+		);
+		context->log_interval = grid->log_interval;
+		context->cache = grid->cache;
+		run_ga(context);
+
+		fclose(output);
+		fclose(advance_log);
+	}
+
+	return NULL;
+}
+
+
+/** 比較実行
+ * 交叉と選択の全ての組み合わせを、それぞれseed_num個の乱数の種で実行する。
+ * 全ての実行を一つのプロセスの中でthread_num個のスレッドに分けて同時に計算するので、
+ * 比較全体にかかる時間は各実行の時間の合計ではなく、最も遅い実行の時間に近くなる。
+ *
+ * 実行毎に乱数生成器を持ち、k番目の種にはseed+kを使うので、スレッドの数によらず同じ結果になる。
+ * 全て終えたら、各実行の世代数と最も高い適応度を標準出力に表示する。
+ *
+ * fitness: 適応度関数。
+ * cache: 全ての実行で共有する適応度のキャッシュ。NULLなら使わない。
+ * log_interval: ログに記録する間隔 (世代数)。
+ * directory: 結果を保存するディレクトリ。あらかじめ作っておくこと。
+ * seed_num: 組み合わせ毎の実行の数。
+ * seed: 最初の実行の乱数の種。
+ * thread_num: 使うスレッドの数。
+ */
+void run_grid(const FitnessFunction *fitness, FitnessCache *cache, const int log_interval, const char *directory, const int seed_num, const unsigned long seed, int thread_num){
+	GridContext grid;
+	pthread_t *threads;
+	char path[PATH_LENGTH];
+	int i;
+
+	pthread_mutex_init(&grid.mutex, NULL);
+	grid.next_job = 0;
+	grid.job_num = (int)(CROSS_TYPE_NUM * CHOICE_TYPE_NUM) * seed_num;
+	grid.seed_num = seed_num;
+	grid.seed = seed;
+	grid.directory = directory;
+	grid.fitness = fitness;
+	grid.cache = cache;
+	grid.log_interval = log_interval;
+	grid.contexts = malloc(sizeof(RunContext) * grid.job_num);
+
+	if(thread_num > grid.job_num){
+		thread_num = grid.job_num;
+	}
+	threads = malloc(sizeof(pthread_t) * thread_num);
+
+	for(i=0; i<thread_num; i++){
+		pthread_create(&threads[i], NULL, grid_thread, &grid);
+	}
+	for(i=0; i<thread_num; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	/* 結果を仕事の順に表示する。 */
+	for(i=0; i<grid.job_num; i++){
+		grid_path(path, &grid, i, "log");
+		printf(
+			"%s: seed %lu, %d generations, best %d%%\n",
+			path,
+			grid.contexts[i].seed,
+			grid.contexts[i].generation_num,
+			grid.contexts[i].best_fitness*100/GENE_LENGTH
+		);
+	}
+
+	free(threads);
+	free(grid.contexts);
+	pthread_mutex_destroy(&grid.mutex);
+}
+
+
+/* 島モデルの移住用の郵便受け。
+ * 送る島と受け取る島の組毎に一つずつあり、それぞれの組で書くのは送る島、読むのは受け取る島だけなので、ロックを使わずにfullで受け渡す。
+ * 送る島はfullが0のときだけ遺伝子を書いて1にし、受け取る島はfullが1のときだけ遺伝子を読んで0に戻す。
+ * fullはGCCの__atomic組み込み関数でacquire/releaseを付けて読み書きする。 */
+typedef struct {
+	GeneWord gene[GENE_WORDS];  /* 移住する遺伝子 */
+	int full;  /* 1なら遺伝子が入っていて、受け取られるのを待っている。 */
+} Mailbox;
+
+
+/* 島モデルの全ての島で共有する情報。 */
+typedef struct {
+	int island_num;  /* 島の数 */
+	int interval;  /* 移住する間隔 (世代数) */
+	int topology;  /* 移住先の決め方。TOPOLOGY_*のいずれか。 */
+	int done;  /* どれかの島が最適解を見つけたら1。__atomic組み込み関数で読み書きする。 */
+	Mailbox *mailboxes;  /* 郵便受け。島fromから島toへの郵便受けはmailboxes[to * island_num + from]。 */
+} Archipelago;
+
+
+/* 一つの島。 */
+typedef struct {
+	Archipelago *archipelago;  /* 全ての島で共有する情報 */
+	int id;  /* 島の番号 */
+	RunContext context;  /* この島の実行 */
+	GeneWord best[GENE_WORDS];  /* 実行を終えたときの最も優秀な遺伝子 */
+} Island;
+
+
+/** 移住者を送る
+ * 島fromから島toへの郵便受けに遺伝子を入れる。
+ * 前に送った遺伝子がまだ受け取られていなければ、何もしない。
+ *
+ * archipelago: 全ての島で共有する情報。
+ * from: 送る島の番号。
+ * to: 受け取る島の番号。
+ * gene: 送る遺伝子。
+ */
+void send_migrant(Archipelago *archipelago, const int from, const int to, const GeneWord gene[GENE_WORDS]){
+	Mailbox *mailbox = &archipelago->mailboxes[to * archipelago->island_num + from];
+
+	if(__atomic_load_n(&mailbox->full, __ATOMIC_ACQUIRE)){
+		return;
+	}
+	memcpy(mailbox->gene, gene, GENE_WORDS * sizeof(GeneWord));
+	__atomic_store_n(&mailbox->full, 1, __ATOMIC_RELEASE);
+}
+
+
+/** 移住者を受け取る
+ * 島に届いている遺伝子を全て受け取り、それぞれその時点で最も適応度の低い遺伝子と入れ替える。
+ * 適応度は受け取った遺伝子の分だけ計算し、一つでも受け取ったら累積和を作り直す。
+ *
+ * archipelago: 全ての島で共有する情報。
+ * context: 受け取る島の実行。
+ * to: 受け取る島の番号。
+ * generation: 受け取った遺伝子を入れる世代。
+ */
+void receive_migrants(Archipelago *archipelago, RunContext *context, const int to, Generation *generation){
+	Mailbox *mailbox;
+	int received = 0;
+	int from, worst;
+
+	for(from=0; from<archipelago->island_num; from++){
+		mailbox = &archipelago->mailboxes[to * archipelago->island_num + from];
+		if(!__atomic_load_n(&mailbox->full, __ATOMIC_ACQUIRE)){
+			continue;
+		}
+
+		worst = find_min_fitness(generation);
+		memcpy(generation->genes[worst], mailbox->gene, GENE_WORDS * sizeof(GeneWord));
+		context->fitness->evaluate((const GeneWord (*)[GENE_WORDS])generation->genes + worst, generation->fitnesses + worst, 1);
+		__atomic_store_n(&mailbox->full, 0, __ATOMIC_RELEASE);
+		received = 1;
+	}
+
+	if(received){
+		accumulate_fitness(generation);
+	}
+}
+
+
+/** 島の計算を終えるか判定する
+ * STOP_WHEN_DONEが定義されていれば、どれかの島が最適解を見つけた時点で全ての島の計算を終える。
+ * この島が最適解を見つけていれば、他の島にも知らせる。
+ *
+ * island: 判定する島。
+ * generation: 島の今の世代。
+ *
+ * return: 計算を終えるなら1、続けるなら0。
+ */
+int island_done(Island *island, const Generation *generation){
+#ifdef STOP_WHEN_DONE
+	if(generation->fitnesses[find_max_fitness(generation)] >= GENE_LENGTH){
+		__atomic_store_n(&island->archipelago->done, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return __atomic_load_n(&island->archipelago->done, __ATOMIC_RELAXED);
+#else
+	(void)island;
+	(void)generation;
+	return 0;
+#endif
+}
+
+
+/** 島のスレッド
+ * 一つの島の個体群をGENE_NUM個の遺伝子で進化させる。
+ * interval世代毎に、最も優秀な遺伝子をトポロジーで決まる島へ送り、届いている遺伝子を受け取る。
+ * 環状 (ring) なら次の番号の島へ、全結合 (full) なら他の全ての島へ送る。
+ *
+ * arg: 計算する島 (Island)。
+ *
+ * return: 常にNULL。
+ */
+void* island_thread(void *arg){
+	Island *island = (Island*)arg;
+	Archipelago *archipelago = island->archipelago;
+	RunContext *context = &island->context;
+	Generation generations[2];  /* 今の世代と次の世代 */
+	Generation *current = &generations[0];
+	Generation *next = &generations[1];
+	Generation *swap;
+	int i, to, best;
+
+	if(context->fitness->delta != NULL){
+		context->deltas = calloc(GENE_NUM, sizeof(GeneDelta));
+	}
+
+	make_genes(&context->random, current->genes);  /* 第一世代を生成 */
+	evaluate_generation(context, current);
+
+	for(i=0; i<LOOP_NUM && !island_done(island, current); i++){
+		next_generation(context, current, next);
+
+		/* 新しい世代を今の世代にする。 */
+		swap = current;
+		current = next;
+		next = swap;
+
+		if((i + 1) % archipelago->interval == 0){
+			best = find_max_fitness(current);
+			if(archipelago->topology == TOPOLOGY_RING){
+				send_migrant(archipelago, island->id, (island->id + 1) % archipelago->island_num, current->genes[best]);
+			}else{
+				for(to=0; to<archipelago->island_num; to++){
+					if(to != island->id){
+						send_migrant(archipelago, island->id, to, current->genes[best]);
+					}
+				}
+			}
+			receive_migrants(archipelago, context, island->id, current);
+		}
+	}
+
+	best = find_max_fitness(current);
+	memcpy(island->best, current->genes[best], GENE_WORDS * sizeof(GeneWord));
+	context->generation_num = i;
+	context->best_fitness = current->fitnesses[best];
+
+	free(context->deltas);
+	context->deltas = NULL;
+
+	return NULL;
+}
+
+
+/** 島モデルで実行する
+ * island_num個の島をそれぞれのスレッドで同時に進化させ、interval世代毎に優秀な遺伝子を移住させる。
+ * 全体の個体の数はisland_num * GENE_NUMになる。
+ * 島kは乱数の種にseed+kを使う。移住のタイミングはスレッドの進み具合によるので、同じ種でも結果は毎回同じにはならない。
+ *
+ * 全ての島が終わったら、島毎の世代数と最も高い適応度、全体で最も優秀な遺伝子を標準出力に表示する。ログは記録しない。
+ *
+ * fitness: 適応度関数。
+ * cache: 全ての島で共有する適応度のキャッシュ。NULLなら使わない。
+ * island_num: 島の数。
+ * interval: 移住する間隔 (世代数)。
+ * topology: 移住先の決め方。TOPOLOGY_*のいずれか。
+ * cross_type: 交叉のタイプ。
+ * choice_type: 選択のタイプ。
+ * seed: 最初の島の乱数の種。
+ */
+void run_islands(
+		const FitnessFunction *fitness,
+		FitnessCache *cache,
+		const int island_num,
+		const int interval,
+		const int topology,
+		const int cross_type,
+		const int choice_type,
+		const unsigned long seed
+){
+	Archipelago archipelago;
+	Island *islands = malloc(sizeof(Island) * island_num);
+	pthread_t *threads = malloc(sizeof(pthread_t) * island_num);
+	int i, best = 0;
+
+	archipelago.island_num = island_num;
+	archipelago.interval = interval;
+	archipelago.topology = topology;
+	archipelago.done = 0;
+	archipelago.mailboxes = calloc(island_num * island_num, sizeof(Mailbox));
+
+	for(i=0; i<island_num; i++){
+		islands[i].archipelago = &archipelago;
+		islands[i].id = i;
+		init_context(&islands[i].context, fitness, cross_type, choice_type, seed + i, stdout, NULL, NULL);
+		islands[i].context.cache = cache;
+		pthread_create(&threads[i], NULL, island_thread, &islands[i]);
+	}
+	for(i=0; i<island_num; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	for(i=0; i<island_num; i++){
+		printf(
+			"island %d: seed %lu, %d generations, best %d%%\n",
+			i,
+			islands[i].context.seed,
+			islands[i].context.generation_num,
+			islands[i].context.best_fitness*100/GENE_LENGTH
+		);
+		if(islands[i].context.best_fitness > islands[best].context.best_fitness){
+			best = i;
+		}
+	}
+	printf("best: ");
+	show_gene(stdout, islands[best].best, islands[best].context.best_fitness);
+
+	free(archipelago.mailboxes);
+	free(threads);
+	free(islands);
+}
+
+
+/** メイン関数
+ * 引数を解析し、一回の実行か比較実行か島モデルの計算を行なう。
+ *
+ * 引数が無ければ、交叉と選択にCROSS_TYPEとCHOICE_TYPEを使って一回実行する。
+ * 世代の情報は標準出力に表示し、ログはLOGFILE_NAMEとADVANCE_LOG_NAMEに記録する。
+ * オプション-xで交叉の方法を、-cで選択の方法を、-sで乱数の種を選べる。
+ *
+ * オプション-gを指定すると、交叉と選択の全ての組み合わせを指定した数の種で並列に実行する (run_grid参照)。
+ * -jで使うスレッドの数を (省略するとCPUの数)、-dで結果を保存するディレクトリを選べる。
+ *
+ * オプション-iを指定すると、指定した数の島で島モデルの計算をする (run_islands参照)。
+ * -mで移住する間隔を、-tで移住先の決め方を選べる。
+ *
+ * オプション-fで適応度関数を選べる (FITNESS_FUNCTIONS参照)。
+ * -wを指定すると、一回の実行で適応度を指定した数のスレッドで並列に計算する (0ならCPUの数)。
+ * 比較実行と島モデルは実行毎にスレッドを使うので、-wは無視する。
+ *
+ * オプション-Cを指定すると、指定した数の遺伝子の適応度をキャッシュし、同じ遺伝子を二度計算しない。
+ * 比較実行と島モデルでは全ての実行でキャッシュを共有する。終わったらキャッシュの統計を標準エラー出力に表示する。
+ * 差分から計算する適応度関数では第一世代にしか効かないので、計算に時間のかかる適応度関数か-Fと合わせて使う。
+ *
+ * オプション-Fを指定すると、一回の実行で適応度を差分からではなく毎回全て計算し直す (差分計算の確認用)。
+ *
+ * オプション-Lを指定すると、ログを指定した世代毎にだけ記録する (最後の世代は必ず記録する)。
+ *
+ * オプション-kを指定すると、一回の実行で-K世代毎 (既定値はCHECKPOINT_INTERVAL) にチェックポイントをそのファイルに書き込む。
+ * -Rを付けると、-kのチェックポイントから計算を再開する。交叉、選択、適応度関数、ログの間隔はチェックポイントのものを使い、
+ * ログファイルはチェックポイントを取ったときの位置から書き継ぐ。
+ */
+int main(const int argc, const char* argv[]){
+	RunContext context;
+	int cross_type = CROSS_TYPE;  /* 交叉のタイプ */
+	int choice_type = CHOICE_TYPE;  /* 選択のタイプ */
+	unsigned long seed = (unsigned long)time(NULL);  /* 乱数の種 */
+	int seed_num = 0;  /* 比較実行での組み合わせ毎の実行の数。0なら比較実行をしない。 */
+	int thread_num = 0;  /* 比較実行に使うスレッドの数。0ならCPUの数。 */
+	const char *directory = GRID_DIRECTORY;  /* 比較実行の結果を保存するディレクトリ */
+	int island_num = 0;  /* 島モデルの島の数。0なら島モデルを使わない。 */
+	int interval = MIGRATION_INTERVAL;  /* 島モデルで移住する間隔 */
+	int topology = TOPOLOGY_RING;  /* 島モデルの移住先の決め方 */
+	int fitness = 0;  /* 適応度関数の番号 */
+	int worker_num = 1;  /* 適応度の計算に使うスレッドの数。0ならCPUの数。 */
+	int full_evaluation = 0;  /* 0以外なら適応度を差分から計算しない */
+	FitnessPool pool;  /* 適応度を並列に計算するスレッドプール */
+	long cache_size = 0;  /* 適応度のキャッシュに覚える遺伝子の数。0ならキャッシュしない。 */
+	FitnessCache cache;  /* 適応度のキャッシュ */
+	int log_interval = 1;  /* ログに記録する間隔 (世代数) */
+	const char *checkpoint_file = NULL;  /* チェックポイントのファイル名 */
+	int checkpoint_interval = CHECKPOINT_INTERVAL;  /* チェックポイントを取る間隔 (世代数) */
+	int resume = 0;  /* 0以外ならチェックポイントから再開する */
+	Checkpointer checkpointer;  /* チェックポイントの書き込み器 */
+	Checkpoint resume_point;  /* 再開するチェックポイント */
+	FILE* log_file;
+	FILE* adv_log_file;
+	int i;
+
+	/* 引数の解析 */
+	for(i=1; i<argc; i++){
+		if(strcmp(argv[i], "-x") == 0 && i+1 < argc){
+			i++;
+			for(cross_type=0; cross_type<(int)CROSS_TYPE_NUM && strcmp(argv[i], CROSS_NAMES[cross_type]) != 0; cross_type++);
+		}else if(strcmp(argv[i], "-c") == 0 && i+1 < argc){
+			i++;
+			for(choice_type=0; choice_type<(int)CHOICE_TYPE_NUM && strcmp(argv[i], CHOICE_NAMES[choice_type]) != 0; choice_type++);
+		}else if(strcmp(argv[i], "-s") == 0 && i+1 < argc){
+			seed = strtoul(argv[++i], NULL, 10);
+		}else if(strcmp(argv[i], "-g") == 0 && i+1 < argc){
+			seed_num = atoi(argv[++i]);
+			if(seed_num < 1){
+				seed_num = -1;
+			}
+		}else if(strcmp(argv[i], "-j") == 0 && i+1 < argc){
+			thread_num = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-d") == 0 && i+1 < argc){
+			directory = argv[++i];
+		}else if(strcmp(argv[i], "-i") == 0 && i+1 < argc){
+			island_num = atoi(argv[++i]);
+			if(island_num < 1){
+				island_num = -1;
+			}
+		}else if(strcmp(argv[i], "-m") == 0 && i+1 < argc){
+			interval = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-t") == 0 && i+1 < argc){
+			i++;
+			for(topology=0; topology<(int)TOPOLOGY_NUM && strcmp(argv[i], TOPOLOGY_NAMES[topology]) != 0; topology++);
+		}else if(strcmp(argv[i], "-f") == 0 && i+1 < argc){
+			i++;
+			for(fitness=0; fitness<(int)FITNESS_FUNCTION_NUM && strcmp(argv[i], FITNESS_FUNCTIONS[fitness].name) != 0; fitness++);
+		}else if(strcmp(argv[i], "-w") == 0 && i+1 < argc){
+			worker_num = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-C") == 0 && i+1 < argc){
+			cache_size = atol(argv[++i]);
+		}else if(strcmp(argv[i], "-F") == 0){
+			full_evaluation = 1;
+		}else if(strcmp(argv[i], "-L") == 0 && i+1 < argc){
+			log_interval = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-k") == 0 && i+1 < argc){
+			checkpoint_file = argv[++i];
+		}else if(strcmp(argv[i], "-K") == 0 && i+1 < argc){
+			checkpoint_interval = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-R") == 0){
+			resume = 1;
+		}else{
+			cross_type = -1;
+		}
+	}
+
+	/* 引数の確認 (引数が正しくないときは実行方法を表示) */
+	if(cross_type < 0 || cross_type >= (int)CROSS_TYPE_NUM || choice_type < 0 || choice_type >= (int)CHOICE_TYPE_NUM
+			|| seed_num < 0 || thread_num < 0 || island_num < 0 || (island_num > 0 && seed_num > 0)
+			|| interval < 1 || topology >= (int)TOPOLOGY_NUM || fitness >= (int)FITNESS_FUNCTION_NUM || worker_num < 0 || cache_size < 0 || log_interval < 1
+			|| checkpoint_interval < 1 || (resume && checkpoint_file == NULL) || (checkpoint_file != NULL && (island_num > 0 || seed_num > 0)) || (full_evaluation && (island_num > 0 || seed_num > 0))){
+		printf("実行方法 : ./a.out [-f target|onemax|trap] [-w WORKERS] [-C ENTRIES] [-F] [-L INTERVAL] [-k CHECKPOINT [-K INTERVAL] [-R]] [-x one|two|rand] [-c roullette|tournament] [-s SEED]\n");
+		printf("           ./a.out -g SEEDS [-j THREADS] [-d DIRECTORY] [-f FITNESS] [-C ENTRIES] [-L INTERVAL] [-s SEED]\n");
+		printf("           ./a.out -i ISLANDS [-m INTERVAL] [-t ring|full] [-f FITNESS] [-C ENTRIES] [-x one|two|rand] [-c roullette|tournament] [-s SEED]\n");
+		exit(1);
+	}
+	if(worker_num == 0){
+		worker_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		worker_num = worker_num > 0 ? worker_num : 1;
+	}
+	if(worker_num != 1 && (island_num > 0 || seed_num > 0)){
+		fprintf(stderr, "each run of -g and -i evaluates fitness on its own thread. -w is ignored.\n");
+		worker_num = 1;
+	}
+
+	if(cache_size > 0){
+		init_fitness_cache(&cache, cache_size);
+	}
+
+	/* 島モデル */
+	if(island_num > 0){
+		run_islands(&FITNESS_FUNCTIONS[fitness], cache_size > 0 ? &cache : NULL, island_num, interval, topology, cross_type, choice_type, seed);
+		if(cache_size > 0){
+			show_fitness_cache(stderr, &cache);
+			free_fitness_cache(&cache);
+		}
+		return 0;
+	}
+
+	/* 比較実行 */
+	if(seed_num > 0){
+		if(thread_num == 0){
+			thread_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+			thread_num = thread_num > 0 ? thread_num : 1;
+		}
+		run_grid(&FITNESS_FUNCTIONS[fitness], cache_size > 0 ? &cache : NULL, log_interval, directory, seed_num, seed, thread_num);
+		if(cache_size > 0){
+			show_fitness_cache(stderr, &cache);
+			free_fitness_cache(&cache);
+		}
+		return 0;
+	}
+
+	if(resume){
+		/* 設定とログの位置はチェックポイントに合わせる */
+		load_checkpoint(checkpoint_file, &resume_point);
+		cross_type = resume_point.header.cross_type;
+		choice_type = resume_point.header.choice_type;
+		fitness = resume_point.header.fitness;
+		log_interval = resume_point.header.log_interval;
+		seed = resume_point.header.seed;
+		log_file = reopen_log(LOGFILE_NAME, resume_point.header.normal_log_position);
+		adv_log_file = reopen_log(ADVANCE_LOG_NAME, resume_point.header.advance_log_position);
+		fprintf(stderr, "resumed at generation %d from \"%s\".\n", resume_point.header.generation + 1, checkpoint_file);
+	}else{
+		if((log_file = fopen(LOGFILE_NAME, "w")) == NULL){
+			printf("main(): Cannot open \"%s\"\n", LOGFILE_NAME);
+			exit(1);
+		}
+		if((adv_log_file = fopen(ADVANCE_LOG_NAME, "w")) == NULL){
+			printf("main(): Cannot open \"%s\"\n", ADVANCE_LOG_NAME);
+			exit(1);
+		}
+	}
+
+	init_context(&context, &FITNESS_FUNCTIONS[fitness], cross_type, choice_type, seed, stdout, log_file, adv_log_file);
+	context.log_interval = log_interval;
+	context.full_evaluation = full_evaluation;
+	if(worker_num > 1){
+		init_fitness_pool(&pool, worker_num);
+		context.pool = &pool;
+	}
+	if(cache_size > 0){
+		context.cache = &cache;
+	}
+	if(checkpoint_file != NULL){
+		init_checkpointer(&checkpointer, checkpoint_file);
+		context.checkpointer = &checkpointer;
+		context.checkpoint_interval = checkpoint_interval;
+	}
+	if(resume){
+		context.resume = &resume_point;
+	}
+	run_ga(&context);
+	if(checkpoint_file != NULL){
+		free_checkpointer(&checkpointer);
+	}
+	if(worker_num > 1){
+		free_fitness_pool(&pool);
+	}
+	if(cache_size > 0){
+		show_fitness_cache(stderr, &cache);
+		free_fitness_cache(&cache);
+	}
 
 	fclose(log_file);
 	fclose(adv_log_file);
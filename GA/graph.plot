@@ -1,18 +1,24 @@
 #!/usr/bin/gnuplot
+# gnuplot -e "advance='compare/one-roullette'" graph.plot のようにadvanceを与えると、
+# そのadvanceログ (advance.log) だけを描く (make compare用)。
 
 set term png size 800,600
 
 set yrange [0:*]
 
-set output "result.png"
-plot "result.log" w l t "average", "" u 1:3 w l t "best"
+if (!exists("advance")) {
+	advance = "advance"
 
-set output "advance.png"
+	set output "result.png"
+	plot "result.log" w l t "average", "" u 1:3 w l t "best"
+}
+
+set output advance.".png"
 set key bottom right
 set yrange [0:100]
 set ylabel "fitneses[%]"
 set xlabel "generation"
-plot "< awk '{ print $1*100, $2*100, $3*100, $4*100 }' advance.log" u 0:2:3 w filledcurves t "" lc rgb "#eeeeee" \
+plot "< awk '{ print $1*100, $2*100, $3*100, $4*100 }' ".advance.".log" u 0:2:3 w filledcurves t "" lc rgb "#eeeeee" \
 ,	"" u 0:3:4 w filledcurves t "" lc rgb "#e0e0e0" \
 ,	"" u 0:2 w l t "best" lc rgb "green" \
 ,	"" u 0:3 w l t "worst" lc rgb "blue" \
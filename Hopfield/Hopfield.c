@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef __AVX2__
+	#include <immintrin.h>
+#endif
 
 
 const char* PATTERN_NAMES[] = {  /* パターンファイルのファイル名一覧 */
@@ -20,8 +23,25 @@ const char* PATTERN_NAMES[] = {  /* パターンファイルのファイル名
 #define PATTERN_HEIGHT	20
 #define PATTERN_SIZE	(PATTERN_WIDTH * PATTERN_HEIGHT)
 
+#define WEIGHT_BITS		8  /* 重みのビット数。8か16。重みの絶対値はPATTERN_NUM以下なので、PATTERN_NUMが127を超えるなら16にする。 */
+#define CACHE_LINE		64  /* キャッシュラインのバイト数。重みの各行はこの境界から始まる。 */
+
 #define TRY_NUM			2  /* 想起の実行回数 */
 #define OUTPUT_LEVEL	1  /* 出力の詳細さ。0なら入力と出力だけ、1なら想起一回ごとの出力、2なら1ビットごとの出力。 */
+#define RECALL_ENGINE	0  /* 想起の方法。0なら自動、1なら重み行列 (remember)、2なら学習パターン (remember_factored)。 */
+#define FACTORED_RATIO	4  /* RECALL_ENGINEが0のとき、PATTERN_NUMのこの倍数がPATTERN_SIZE以下なら学習パターンから想起する。 */
+
+/* 重みの型。出力 (1か-1) も同じ型に詰めて、重みの行との内積をまとめて計算する (local_field参照)。 */
+#if WEIGHT_BITS == 8
+	typedef signed char Weight;
+	#define WEIGHT_MAX	127
+#else
+	typedef short Weight;
+	#define WEIGHT_MAX	32767
+#endif
+
+#define ROW_LENGTH	((PATTERN_SIZE * sizeof(Weight) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE / sizeof(Weight))  /* 重みの一行の要素数。一行がキャッシュラインの倍数になるように0で埋める。 */
+
 
 /* 表示に使う文字 */
 #if 1 && (defined(unix) || defined(__unix) || defined(__unix__) || defined(__APPLE__))  /* *NIXならカラフルに表示しようとする。先頭の1を0にして無効化。 */
@@ -121,19 +141,20 @@ void read_patterns(int dest[PATTERN_NUM][PATTERN_SIZE]){
 
 /** 複数の入力パターンから重みを決定する
  * パターンの配列を受け取り、ホップフィールドネットワークの重みを決定する。
+ * 各行のPATTERN_SIZE番目からROW_LENGTHまでは0で埋める。
  *
  * patterns: 学習する入力パターンの配列。1か-1の値を取る。
  * weight: 学習結果を保存する先。weight[i][j]はニューロンiからニューロンjへの重みを示す。
  */
 void learn(
 		const int patterns[PATTERN_NUM][PATTERN_SIZE],
-		int weight[PATTERN_SIZE][PATTERN_SIZE]
+		Weight weight[PATTERN_SIZE][ROW_LENGTH]
 ){
 	int pattern_id, i, j;
 
 	/* weightを初期化 */
 	for(i=0; i<PATTERN_SIZE; i++){
-		for(j=0; j<PATTERN_SIZE; j++){
+		for(j=0; j<ROW_LENGTH; j++){
 			weight[i][j] = 0;
 		}
 	}
@@ -170,26 +191,121 @@ void make_noise(int pattern[PATTERN_SIZE], const double level){
 }
 
 
+/** 内部状態の計算
+ * 重みの一行と出力の内積を計算する。
+ * 出力は1か-1なので、掛け算の代わりに出力が負の要素だけ重みの符号を反転して足し合わせる。
+ * AVX2が使えれば、一命令で256ビット分の要素をまとめて処理する。
+ *
+ * row: 重みの一行。CACHE_LINEの境界から始まり、ROW_LENGTHまで0で埋まっていること。
+ * state: 出力をWeightに詰めたもの。ROW_LENGTHの要素を持つ。
+ *
+ * return: 内部状態の値。
+ */
+int local_field(const Weight row[ROW_LENGTH], const Weight state[ROW_LENGTH]){
+#ifdef __AVX2__
+	__m256i sum = _mm256_setzero_si256();  /* 32ビットの部分和8つ */
+	__m256i product;
+	int i;
+
+	for(i=0; i<ROW_LENGTH; i+=32/sizeof(Weight)){
+	#if WEIGHT_BITS == 8
+		product = _mm256_sign_epi8(_mm256_load_si256((const __m256i*)(row + i)), _mm256_loadu_si256((const __m256i*)(state + i)));
+		product = _mm256_maddubs_epi16(_mm256_set1_epi8(1), product);  /* 隣り合う二つを16ビットで足す */
+	#else
+		product = _mm256_sign_epi16(_mm256_load_si256((const __m256i*)(row + i)), _mm256_loadu_si256((const __m256i*)(state + i)));
+	#endif
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(product, _mm256_set1_epi16(1)));  /* 隣り合う二つを32ビットで足す */
+	}
+
+	/* 8つの部分和を足す */
+	sum = _mm256_add_epi32(sum, _mm256_permute2x128_si256(sum, sum, 1));
+	sum = _mm256_hadd_epi32(sum, sum);
+	sum = _mm256_hadd_epi32(sum, sum);
+	return _mm256_cvtsi256_si32(sum);
+#else
+	int net = 0;
+	int j;
+
+	for(j=0; j<PATTERN_SIZE; j++){
+		net += row[j] * state[j];
+	}
+	return net;
+#endif
+}
+
+
 /** 想起
  * 与えられた重みと入力から想起を行ない、結果を配列に格納する。
  *
- * weight: 想起に使用する重み。1か-1のいずれかの値の配列。
+ * weight: 想起に使用する重み。learn()で作ったもの。
  * pattern: 入力データ兼出力の保存先。
  * show_progress: 0以外なら途中経過を出力する。
  */
 void remember(
-		const int weight[PATTERN_SIZE][PATTERN_SIZE],
+		const Weight weight[PATTERN_SIZE][ROW_LENGTH],
+		int pattern[PATTERN_SIZE],
+		const int show_progress
+){
+	Weight state[ROW_LENGTH];  /* 出力をWeightに詰めたもの。PATTERN_SIZE番目からは0。 */
+	int i;
+
+	for(i=0; i<ROW_LENGTH; i++){
+		state[i] = i < PATTERN_SIZE ? pattern[i] : 0;
+	}
+
+	for(i=0; i<PATTERN_SIZE; i++){
+		pattern[i] = step_func(local_field(weight[i], state), pattern[i]);
+		state[i] = pattern[i];
+
+		/* 出力パターンを表示する */
+		if(show_progress){
+			display_pattern(pattern);
+		}
+	}
+}
+
+
+/** 学習パターンから想起
+ * 重み行列を作らずに、学習パターンと今の出力との重なりから想起を行なう。結果はremember()と全く同じになる。
+ * 重みはweight[i][j] = Σ_p patterns[p][i] * patterns[p][j] (i≠j) なので、
+ * 重なりをoverlap[p] = Σ_j patterns[p][j] * pattern[j] とするとニューロンiの内部状態は
+ * Σ_p patterns[p][i] * overlap[p] - PATTERN_NUM * pattern[i] になる。
+ * 重なりは出力が変わったときだけ更新するので、1ビットあたりの計算はPATTERN_SIZEではなくPATTERN_NUMに比例する。
+ *
+ * patterns: 学習したパターンの配列。1か-1の値を取る。
+ * pattern: 入力データ兼出力の保存先。
+ * show_progress: 0以外なら途中経過を出力する。
+ */
+void remember_factored(
+		const int patterns[PATTERN_NUM][PATTERN_SIZE],
 		int pattern[PATTERN_SIZE],
 		const int show_progress
 ){
-	int i, j, net;
+	int overlap[PATTERN_NUM];  /* 各学習パターンと今の出力との重なり */
+	int pattern_id, i, net, out;
+
+	/* 重なりの初期値を計算 */
+	for(pattern_id=0; pattern_id<PATTERN_NUM; pattern_id++){
+		overlap[pattern_id] = 0;
+		for(i=0; i<PATTERN_SIZE; i++){
+			overlap[pattern_id] += patterns[pattern_id][i] * pattern[i];
+		}
+	}
 
 	for(i=0; i<PATTERN_SIZE; i++){
-		net = 0;
-		for(j=0; j<PATTERN_SIZE; j++){
-			net += weight[i][j] * pattern[j];
+		net = -(int)PATTERN_NUM * pattern[i];  /* 自分自身への重みは0なので、その分を引いておく */
+		for(pattern_id=0; pattern_id<PATTERN_NUM; pattern_id++){
+			net += patterns[pattern_id][i] * overlap[pattern_id];
+		}
+		out = step_func(net, pattern[i]);
+
+		/* 出力が変わったら重なりを更新する */
+		if(out != pattern[i]){
+			for(pattern_id=0; pattern_id<PATTERN_NUM; pattern_id++){
+				overlap[pattern_id] += patterns[pattern_id][i] * (out - pattern[i]);
+			}
+			pattern[i] = out;
 		}
-		pattern[i] = step_func(net, pattern[i]);
 
 		/* 出力パターンを表示する */
 		if(show_progress){
@@ -224,10 +340,15 @@ double calc_score(const int output[PATTERN_SIZE], const int answer[PATTERN_SIZE]
 /** メイン関数
  * 引数で入力するパターンのIDと発生させるノイズの量を受け取り、計算結果を表示する。
  * 想起の処理はTRY_NUM回繰り返し行なわれる。
+ *
+ * 想起の方法はRECALL_ENGINEで選ぶ。自動なら、パターンの数がニューロンの数より十分少ないときは
+ * 重み行列を作らずに学習パターンから想起し (remember_factored)、そうでなければ重み行列を使う (remember)。
  */
 int main(const int argc, const char *argv[]){
 	int pattern[PATTERN_NUM][PATTERN_SIZE];  /* 学習パターン */
-	int weight[PATTERN_SIZE][PATTERN_SIZE];  /* 重み */
+	void *weight_memory = NULL;  /* 重みのために確保した領域 */
+	Weight (*weight)[ROW_LENGTH];  /* 重み。weight_memoryの中のCACHE_LINEの境界から始まる。学習パターンから想起するときは作らない。 */
+	int factored;  /* 0以外なら学習パターンから想起する */
 	int out[PATTERN_SIZE];  /* 出力 */	 
 	int input_id;  /* 入力パターンの番号 */ 
 	double noise_level;  /* ノイズレベル */	
@@ -270,7 +391,24 @@ int main(const int argc, const char *argv[]){
 	srand(time(NULL));  /* 乱数生成器の初期化。 */
 
 	read_patterns(pattern);  /* 学習パターンの読み込み。 */
-	learn((const int (*)[PATTERN_SIZE])pattern, weight);  /* 相関学習 */
+
+	if(RECALL_ENGINE == 0){
+		factored = PATTERN_NUM * FACTORED_RATIO <= PATTERN_SIZE;
+	}else{
+		factored = RECALL_ENGINE == 2;
+	}
+	if(!factored){
+		if(PATTERN_NUM > WEIGHT_MAX){
+			fprintf(stderr, "too many patterns for %d bit weights. set WEIGHT_BITS to 16.\n", WEIGHT_BITS);
+			return -1;
+		}
+		if((weight_memory = malloc(sizeof(Weight) * PATTERN_SIZE * ROW_LENGTH + CACHE_LINE)) == NULL){
+			fprintf(stderr, "cannot allocate weight.\n");
+			return -1;
+		}
+		weight = (Weight (*)[ROW_LENGTH])((char*)weight_memory + (CACHE_LINE - (size_t)weight_memory % CACHE_LINE) % CACHE_LINE);
+		learn((const int (*)[PATTERN_SIZE])pattern, weight);  /* 相関学習 */
+	}
 
 	for(i=0; i<loop; i++){
 		memcpy(out, pattern[input_id], PATTERN_SIZE * sizeof(int));  /* 入力パターンを出力用の配列にコピーする。 */
@@ -282,7 +420,11 @@ int main(const int argc, const char *argv[]){
 
 		/* TRY_NUMの回数分だけ想起処理を行なう。 */
 		for(j=0; j<TRY_NUM; j++){
-			remember((const int (*)[PATTERN_SIZE])weight, out, OUTPUT_LEVEL >= 2);
+			if(factored){
+				remember_factored((const int (*)[PATTERN_SIZE])pattern, out, OUTPUT_LEVEL >= 2);
+			}else{
+				remember((const Weight (*)[ROW_LENGTH])weight, out, OUTPUT_LEVEL >= 2);
+			}
 
 			if(OUTPUT_LEVEL >= 1 && loop == 1){
 				display_pattern(out);  /* 各想起ごとの出力を表示する。 */
@@ -298,5 +440,7 @@ int main(const int argc, const char *argv[]){
 
 	printf("score: %0.2lf%%\n", score/loop*100);
 
+	free(weight_memory);
+
 	return 0;
 }
@@ -18,7 +18,7 @@ else:
 	#	print(r'\end{description}')
 	#	print('\n')
 
-	for match in re.finditer(r'/\*\*.*?\n(?P<doc>.*?)\*/\n(void|int|double)\*? (?P<func>\w+?)\(', dat, re.DOTALL):
+	for match in re.finditer(r'/\*\*.*?\n(?P<doc>(?:(?!\*/).)*?)\*/\n(void|int|double)\*? (?P<func>\w+?)\(', dat, re.DOTALL):
 		funcname = match.group('func')
 		doc = '\n'.join(x.strip('* ') for x in match.group('doc').splitlines()).strip()
 